@@ -0,0 +1,40 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rejit.h"
+
+// Prints the dates, email addresses, and hex numbers in its input, using
+// patterns rejitc compiled to C at build time (see fbuildroot.py), so nothing
+// is compiled when it runs. Each pattern is one group around the whole match.
+
+extern const rejit_static date, email, hex;
+
+int main() {
+    const rejit_static* pats[] = {&date, &email, &hex};
+    const char* names[] = {"date", "email", "hex"};
+    rejit_matcher m[3];
+    rejit_group groups[1];
+    const char* at;
+    char line[4096];
+    int i;
+
+    for (i=0; i<3; ++i)
+        if ((m[i] = rejit_static_matcher(pats[i])) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\n")] = 0;
+        for (i=0; i<3; ++i)
+            for (at = line; rejit_search(m[i], at, NULL, groups) != -1;
+                 at = groups[0].end)
+                printf("%s: %.*s\n", names[i],
+                       (int)(groups[0].end-groups[0].begin), groups[0].begin);
+    }
+    for (i=0; i<3; ++i) rejit_free_matcher(m[i]);
+    return 0;
+}
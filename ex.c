@@ -22,6 +22,7 @@ rejit_matcher compile(char* regex) {
         case RJ_PE_INT: ERR("expected integer"); break;
         case RJ_PE_LBVAR: ERR("lookbehind cannot be variable-length"); break;
         case RJ_PE_MEM: ERR("out of memory"); break;
+        case RJ_PE_REDOS: ERR("pattern can backtrack exponentially"); break;
         }
         ERR("\n");
         return NULL;
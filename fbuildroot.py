@@ -108,7 +108,7 @@ def configure(ctx):
 
     c = guess_static(ctx, exe=ctx.options.cc, flags=flags, includes=['utf', 'src'],
         platform_options=[
-            ({'posix'}, {'external_libs+': ['rt']}),
+            ({'posix'}, {'external_libs+': ['rt', 'pthread']}),
             ({'gcc'}, {'flags+': ['-Wno-maybe-uninitialized']}),
             ({'clang'}, {'flags+': ['-Wno-unknown-warning-option']}),
         ],
@@ -137,6 +137,21 @@ def configure(ctx):
     return Record(dasm=dasm, c=c, arch=arch, tests=tests, testflags=testflags,
                   headerdoc=headerdoc)
 
+# Patterns the aot example matches with, compiled to C by rejitc.
+AOT_PATTERNS = [
+    ('date', r'([0-9]{4}-[0-9]{2}-[0-9]{2})'),
+    ('email', r'([a-zA-Z0-9._%+-]+@[a-zA-Z0-9.-]+[.][a-zA-Z]+)'),
+    ('hex', r'(0[xX][0-9a-fA-F]+)'),
+]
+
+def rejitc(ctx, exe, dst, patterns):
+    dst = Path.addroot(dst, ctx.buildroot)
+    cmd = [exe, '-o', dst]
+    for name, pattern in patterns:
+        cmd.extend((name, pattern))
+    ctx.execute(cmd, 'rejitc', dst, color='yellow')
+    return dst
+
 def build(ctx):
     rec = configure(ctx)
     src = rec.dasm.translate('src/x86_64.dasc', 'codegen.c')
@@ -144,6 +159,10 @@ def build(ctx):
         includes=['.', ctx.buildroot])
     rec.c.build_exe('bench', ['bench.c'], libs=[rejit])
     rec.c.build_exe('ex', ['ex.c'], libs=[rejit])
+    rec.c.build_exe('parsebench', ['parsebench.c'], libs=[rejit])
+    exe = rec.c.build_exe('rejitc', ['rejitc.c'], libs=[rejit])
+    patterns = rejitc(ctx, exe, 'aot_patterns.c', AOT_PATTERNS)
+    rec.c.build_exe('aot', ['aot.c', patterns], libs=[rejit])
     if rec.tests:
         rec.c.build_exe('tst', ['tst.c'], cflags=rec.testflags, libs=[rejit])
 
@@ -0,0 +1,104 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <rejit.h>
+
+// Times parsing, optimizing, and compiling of generated patterns as they grow:
+// blocklist style alternations of literal words, the same with a character
+// class in each branch (so nothing can be factored), and nested groups.
+// Compilation recurses once per nesting level, so groups are nested a tenth as
+// deep as the alternations are wide.
+
+double get_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static unsigned long seed = 1;
+
+static char rnd() {
+    seed = seed * 6364136223846793005lu + 1442695040888963407lu;
+    return 'a' + (seed >> 33) % 26;
+}
+
+char* gen_words(int n, int sets) {
+    int i, j, len;
+    char* res = malloc((size_t)n*16+1), *p = res;
+    if (!res) return NULL;
+    for (i=0; i<n; ++i) {
+        if (i) *p++ = '|';
+        len = 4 + i % 6;
+        for (j=0; j<len; ++j) *p++ = rnd();
+        if (sets) {
+            memcpy(p, "[0-9]", 5);
+            p += 5;
+        }
+    }
+    *p = 0;
+    return res;
+}
+
+char* gen_nested(int n) {
+    int i;
+    char* res = malloc((size_t)n*2+2), *p = res;
+    if (!res) return NULL;
+    for (i=0; i<n; ++i) *p++ = '(';
+    *p++ = 'a';
+    for (i=0; i<n; ++i) *p++ = ')';
+    *p = 0;
+    return res;
+}
+
+int bench(const char* name, int n, char* regex) {
+    double start, mid, opt, end;
+    rejit_parse_error err;
+    rejit_parse_result res;
+    rejit_matcher m;
+    if (!regex) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    start = get_time();
+    res = rejit_parse(regex, &err, RJ_FNONE);
+    mid = get_time();
+    if (err.kind != RJ_PE_NONE) {
+        fprintf(stderr, "%s/%d: error %d at %zu\n", name, n, err.kind, err.pos);
+        free(regex);
+        return 1;
+    }
+    rejit_optimize(&res, RJ_OALL);
+    opt = get_time();
+    m = rejit_compile(res, RJ_FNONE);
+    end = get_time();
+
+    printf("%-8s n=%-7d %9zu bytes: parse %8.2fms optimize %8.2fms "
+           "compile %8.2fms\n", name, n, strlen(regex), (mid-start)*1000,
+           (opt-mid)*1000, (end-opt)*1000);
+    rejit_free_parse_result(res);
+    rejit_free_matcher(m);
+    free(regex);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    static const int sizes[] = {1000, 10000, 100000};
+    int i, n, r = 0;
+
+    for (i=0; i<(argc > 1 ? argc-1 : 3); ++i) {
+        n = argc > 1 ? atoi(argv[i+1]) : sizes[i];
+        if (n <= 0) {
+            fprintf(stderr, "usage: %s [alternatives...]\n", argv[0]);
+            return 1;
+        }
+        r |= bench("words", n, gen_words(n, 0));
+        r |= bench("sets", n, gen_words(n, 1));
+        r |= bench("nested", n/10, gen_nested(n/10));
+    }
+
+    return r;
+}
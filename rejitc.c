@@ -0,0 +1,72 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rejit.h"
+
+// Compiles patterns to C ahead of time. Each name/pattern pair becomes a
+// rejit_static with that name; see aot.c for one in use.
+
+#define ERR(...) fprintf(stderr, __VA_ARGS__)
+
+static int usage(const char* argv0) {
+    ERR("usage: %s [-i] [-s] [-u] [-o <file>] <name> <regex> ...\n"
+        "  -i  case insensitive\n"
+        "  -s  make . match newlines too\n"
+        "  -u  make character classes Unicode-aware\n"
+        "  -o  write to <file> instead of stdout\n", argv0);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    rejit_flags flags = RJ_FNONE;
+    rejit_parse_result p;
+    rejit_parse_error err;
+    const char* path = NULL;
+    FILE* f = stdout;
+    int i;
+
+    for (i=1; i<argc && argv[i][0] == '-'; ++i)
+        if (!strcmp(argv[i], "-i")) flags |= RJ_FICASE;
+        else if (!strcmp(argv[i], "-s")) flags |= RJ_FDOTALL;
+        else if (!strcmp(argv[i], "-u")) flags |= RJ_FUNICODE;
+        else if (!strcmp(argv[i], "-o") && i+1 < argc) path = argv[++i];
+        else return usage(argv[0]);
+    if (i == argc || (argc-i) % 2) return usage(argv[0]);
+
+    if (path && (f = fopen(path, "w")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    fprintf(f, "// Generated by rejitc. Do not edit.\n\n");
+    for (; i<argc; i += 2) {
+        p = rejit_parse(argv[i+1], &err, flags);
+        if (err.kind != RJ_PE_NONE) {
+            ERR("%s: parse error at %zu\n", argv[i], err.pos);
+            rejit_free_parse_result(p);
+            goto fail;
+        }
+        rejit_optimize(&p, RJ_OALL);
+        if (rejit_emit_c(f, argv[i], p, flags) == -1) {
+            ERR("%s: couldn't write it out\n", argv[i]);
+            rejit_free_parse_result(p);
+            goto fail;
+        }
+        rejit_free_parse_result(p);
+    }
+    if (f != stdout && fclose(f) != 0) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+
+fail:
+    if (f != stdout) {
+        fclose(f);
+        remove(path);
+    }
+    return 1;
+}
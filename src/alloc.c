@@ -0,0 +1,33 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+   License, v. 2.0. If a copy of the MPL was not distributed with this
+   file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "rejit.h"
+
+#include <stdlib.h>
+
+// Each thread has its own, so threads compiling with different arenas never
+// see each other's.
+static __thread rejit_allocator current;
+
+void rejit_set_allocator(const rejit_allocator* a) {
+    if (a) current = *a;
+    else memset(&current, 0, sizeof(current));
+}
+
+rejit_allocator rejit_get_allocator(void) { return current; }
+
+// A NULL allocator means the calling thread's, for memory that's freed before
+// the call that allocated it returns.
+void* rejit_alloc(rejit_allocator* a, size_t sz) {
+    if (a == NULL) a = &current;
+    return a->alloc ? a->alloc(a->ctx, sz) : malloc(sz);
+}
+
+void rejit_free(rejit_allocator* a, void* p) {
+    if (a == NULL) a = &current;
+    // Allocators don't have to take NULL the way free does.
+    if (p == NULL) return;
+    if (!a->alloc) free(p);
+    else if (a->free) a->free(a->ctx, p);
+}
@@ -0,0 +1,674 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+   License, v. 2.0. If a copy of the MPL was not distributed with this
+   file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "rejit.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include "utf/utf.h"
+
+// Questions about what a pattern can match, answered from its instructions
+// alone so search can pick where to try it.
+
+#define CHAINED(ia,e) ((ia) != (e) && (ia)->kind == RJ_IOR &&\
+                       (rejit_instruction*)(ia)->value2 == (e))
+
+static rejit_instruction* expr_end(rejit_instruction* instr) {
+    if (instr->kind == RJ_IOR) return (rejit_instruction*)instr->value2;
+    else if (instr->kind > RJ_IVARG) return (rejit_instruction*)instr->value;
+    else if (instr->kind > RJ_IARG) return expr_end(instr+1);
+    else return instr+1;
+}
+
+// Whether every match of b..e starts with ^.
+static int begins(rejit_instruction* b, rejit_instruction* e) {
+    rejit_instruction* mid;
+    if (b == e) return 0;
+    switch (b->kind) {
+    case RJ_IBEGIN: return 1;
+    case RJ_IGROUP: case RJ_ICGROUP:
+        return begins(b+1, (rejit_instruction*)b->value);
+    case RJ_IOR:
+        e = (rejit_instruction*)b->value2;
+        for (;; b = mid) {
+            mid = (rejit_instruction*)b->value;
+            if (!begins(b+1, mid)) return 0;
+            if (!CHAINED(mid, e)) return begins(mid, e);
+        }
+    default: return 0;
+    }
+}
+
+// Whether every match of b..e ends with $.
+static int ends(rejit_instruction* b, rejit_instruction* e) {
+    rejit_instruction* last, *mid;
+    if (b == e) return 0;
+    for (last = b; expr_end(last) != e; last = expr_end(last));
+    switch (last->kind) {
+    case RJ_IEND: return 1;
+    case RJ_IGROUP: case RJ_ICGROUP:
+        return ends(last+1, (rejit_instruction*)last->value);
+    case RJ_IOR:
+        for (;; last = mid) {
+            mid = (rejit_instruction*)last->value;
+            if (!ends(last+1, mid)) return 0;
+            if (!CHAINED(mid, e)) return ends(mid, e);
+        }
+    default: return 0;
+    }
+}
+
+// Whether b..e starts with a loop over any character.
+static int dotstar(rejit_instruction* b, rejit_instruction* e) {
+    if (b == e) return 0;
+    switch (b->kind) {
+    case RJ_ISTAR: case RJ_IMSTAR: case RJ_IPLUS: case RJ_IMPLUS:
+        return b[1].kind == RJ_IDOT;
+    case RJ_IGROUP: case RJ_ICGROUP:
+        return dotstar(b+1, (rejit_instruction*)b->value);
+    default: return 0;
+    }
+}
+
+rejit_anchor rejit_anchoring(rejit_instruction* instrs) {
+    rejit_instruction* e;
+    rejit_anchor res = RJ_ANONE;
+    int caret = 0, moved = 0;
+    for (e = instrs; e->kind; ++e) {
+        if (e->kind == RJ_IBEGIN) caret = 1;
+        if (e->kind == RJ_ILBEHIND || e->kind == RJ_INLBEHIND ||
+            e->kind == RJ_IBACK)
+            moved = 1;
+    }
+    if (caret) {
+        if (begins(instrs, e)) res = RJ_ABEGIN;
+    // ^ matches wherever an attempt starts, a lookbehind can't look back past
+    // it, and a backreference can repeat what the .* took from it. Any of
+    // them could let a later attempt succeed after a leading .* failed.
+    } else if (!moved && dotstar(instrs, e)) res = RJ_ADOTSTAR;
+    if (ends(instrs, e)) res |= RJ_AEND;
+    return res;
+}
+
+// Lengths saturate, and a max of -1 means there is no limit.
+static long add_min(long a, long b) { return a > LONG_MAX-b ? LONG_MAX : a+b; }
+
+static long add_max(long a, long b) {
+    return a == -1 || b == -1 || a > LONG_MAX-b ? -1 : a+b;
+}
+
+static long mul_min(long a, long n) {
+    return n && a > LONG_MAX/n ? LONG_MAX : a*n;
+}
+
+static long mul_max(long a, long n) {
+    if (a == 0 || n == 0) return 0;
+    return a == -1 || a > LONG_MAX/n ? -1 : a*n;
+}
+
+static void bounds(rejit_instruction* b, rejit_instruction* e, long* min,
+                   long* max);
+
+// The bytes the longest member of the set s takes. UTF-8 members take as many
+// as they're written with.
+static long set_max(char* s) {
+    Rune r;
+    long max = 1, rl;
+    for (; *s; s += rl) if ((rl = chartorune(&r, s)) > max) max = rl;
+    return max;
+}
+
+static void bounds_one(rejit_instruction* instr, long* min, long* max) {
+    rejit_instruction* e, *mid;
+    long a, b;
+    switch (instr->kind) {
+    case RJ_IWORD: *min = *max = strlen((char*)instr->value); break;
+    case RJ_IDOT: *min = *max = 1; break;
+    case RJ_ISET:
+        *min = 1;
+        *max = set_max((char*)instr->value);
+        break;
+    // [^x] also matches the end of the input without consuming it.
+    case RJ_INSET: *min = 0; *max = 1; break;
+    case RJ_IUSET: *min = 1; *max = UTFmax; break;
+    case RJ_IBACK: *min = 0; *max = -1; break;
+    case RJ_IBEGIN: case RJ_IEND: case RJ_ILAHEAD: case RJ_INLAHEAD:
+    case RJ_ILBEHIND: case RJ_INLBEHIND:
+        *min = *max = 0;
+        break;
+    case RJ_ISTAR: case RJ_IMSTAR: case RJ_IPLUS: case RJ_IMPLUS:
+        bounds_one(instr+1, min, max);
+        if (instr->kind == RJ_ISTAR || instr->kind == RJ_IMSTAR) *min = 0;
+        if (*max) *max = -1;
+        break;
+    case RJ_IOPT:
+        bounds_one(instr+1, min, max);
+        *min = 0;
+        break;
+    case RJ_IREP:
+        bounds_one(instr+1, min, max);
+        *min = mul_min(*min, instr->value);
+        // {n,} leaves the maximum at 0, and the loop then runs n times.
+        *max = mul_max(*max, instr->value2 > instr->value ? instr->value2 :
+                                                            instr->value);
+        break;
+    case RJ_IGROUP: case RJ_ICGROUP:
+        bounds(instr+1, (rejit_instruction*)instr->value, min, max);
+        break;
+    case RJ_IOR:
+        e = (rejit_instruction*)instr->value2;
+        *min = LONG_MAX;
+        *max = 0;
+        for (;; instr = mid) {
+            mid = (rejit_instruction*)instr->value;
+            bounds(instr+1, mid, &a, &b);
+            if (a < *min) *min = a;
+            if (*max != -1 && (b == -1 || b > *max)) *max = b;
+            if (!CHAINED(mid, e)) break;
+        }
+        bounds(mid, e, &a, &b);
+        if (a < *min) *min = a;
+        if (*max != -1 && (b == -1 || b > *max)) *max = b;
+        break;
+    default: *min = 0; *max = -1; break;
+    }
+}
+
+static void bounds(rejit_instruction* b, rejit_instruction* e, long* min,
+                   long* max) {
+    long a, z;
+    *min = *max = 0;
+    for (; b != e; b = expr_end(b)) {
+        bounds_one(b, &a, &z);
+        *min = add_min(*min, a);
+        *max = add_max(*max, z);
+    }
+}
+
+void rejit_length_bounds(rejit_instruction* instrs, long* min, long* max) {
+    rejit_instruction* e;
+    for (e = instrs; e->kind; ++e);
+    bounds(instrs, e, min, max);
+}
+
+// What every match of an expression has to contain. When exact is set, the
+// expression only ever matches pre, and suf and in are unused.
+typedef struct lits_type {
+    int exact;
+    char* pre, *suf, *in;
+    size_t prelen, suflen, inlen;
+} lits;
+
+typedef struct analyze_ctx_type {
+    rejit_analysis* res;
+    // Whether anything but words was seen, so the pattern isn't a plain
+    // literal even if it matches one string.
+    int special;
+} analyze_ctx;
+
+#define SUF(l) ((l)->exact ? (l)->pre : (l)->suf)
+#define SUFLEN(l) ((l)->exact ? (l)->prelen : (l)->suflen)
+#define IN(l) ((l)->exact ? (l)->pre : (l)->in)
+#define INLEN(l) ((l)->exact ? (l)->prelen : (l)->inlen)
+
+// Running out of memory only loses literals, which are all optional.
+static char* lit_cat(const char* a, size_t alen, const char* b, size_t blen) {
+    char* res;
+    if (alen+blen == 0 || (res = malloc(alen+blen+1)) == NULL) return NULL;
+    memcpy(res, a, alen);
+    memcpy(res+alen, b, blen);
+    res[alen+blen] = 0;
+    return res;
+}
+
+// Turn a finished literal into a string, or NULL if it's empty.
+static char* lit_end(char* s, size_t len) {
+    if (s == NULL || len == 0) {
+        free(s);
+        return NULL;
+    }
+    s[len] = 0;
+    return s;
+}
+
+static void lits_free(lits* l) {
+    free(l->pre);
+    free(l->suf);
+    free(l->in);
+    memset(l, 0, sizeof(lits));
+}
+
+static void lits_exact(lits* l, const char* s, size_t len) {
+    memset(l, 0, sizeof(lits));
+    l->exact = 1;
+    if ((l->pre = lit_cat(s, len, "", 0)) != NULL) l->prelen = len;
+}
+
+// Keep a literal every match of l has somewhere, but drop its ends.
+static void lits_inexact(lits* l) {
+    if (!l->exact) return;
+    l->exact = 0;
+    l->suf = lit_cat(l->pre, l->prelen, "", 0);
+    l->in = lit_cat(l->pre, l->prelen, "", 0);
+    l->suflen = l->suf ? l->prelen : 0;
+    l->inlen = l->in ? l->prelen : 0;
+}
+
+static void lits_seq(lits* a, lits* b) {
+    lits r;
+    char* mid;
+    size_t midlen;
+    memset(&r, 0, sizeof(lits));
+    if (a->exact && b->exact) {
+        r.exact = 1;
+        r.pre = lit_cat(a->pre, a->prelen, b->pre, b->prelen);
+        r.prelen = r.pre ? a->prelen+b->prelen : 0;
+    } else {
+        if (a->exact) {
+            r.pre = lit_cat(a->pre, a->prelen, b->pre, b->prelen);
+            r.prelen = r.pre ? a->prelen+b->prelen : 0;
+        } else {
+            r.pre = a->pre;
+            r.prelen = a->prelen;
+            a->pre = NULL;
+        }
+        if (b->exact) {
+            r.suf = lit_cat(SUF(a), SUFLEN(a), b->pre, b->prelen);
+            r.suflen = r.suf ? SUFLEN(a)+b->prelen : 0;
+        } else {
+            r.suf = b->suf;
+            r.suflen = b->suflen;
+            b->suf = NULL;
+        }
+        // The longest of what's inside either side and what spans the two.
+        mid = lit_cat(SUF(a), SUFLEN(a), b->pre, b->prelen);
+        midlen = mid ? SUFLEN(a)+b->prelen : 0;
+        if (INLEN(a) >= INLEN(b) && INLEN(a) > midlen) {
+            r.in = lit_cat(IN(a), INLEN(a), "", 0);
+            r.inlen = r.in ? INLEN(a) : 0;
+            free(mid);
+        } else if (INLEN(b) > midlen) {
+            r.in = lit_cat(IN(b), INLEN(b), "", 0);
+            r.inlen = r.in ? INLEN(b) : 0;
+            free(mid);
+        } else {
+            r.in = mid;
+            r.inlen = midlen;
+        }
+    }
+    lits_free(a);
+    lits_free(b);
+    *a = r;
+}
+
+// Narrow a to what it shares with another alternative b.
+static void lits_alt(lits* a, lits* b) {
+    size_t n;
+    if (a->exact && b->exact && a->prelen == b->prelen &&
+        memcmp(a->pre, b->pre, a->prelen) == 0) {
+        lits_free(b);
+        return;
+    }
+    lits_inexact(a);
+    lits_inexact(b);
+    for (n=0; n<a->prelen && n<b->prelen && a->pre[n] == b->pre[n]; ++n);
+    a->prelen = n;
+    for (n=0; n<a->suflen && n<b->suflen &&
+              a->suf[a->suflen-n-1] == b->suf[b->suflen-n-1]; ++n);
+    if (n) memmove(a->suf, a->suf+a->suflen-n, n);
+    a->suflen = n;
+    // Whatever the alternatives share inside isn't worth looking for.
+    a->inlen = 0;
+    lits_free(b);
+}
+
+static void set_add(uint8_t* set, unsigned char ch, rejit_flags flags) {
+    set[ch/8] |= 1<<ch%8;
+    if (flags & RJ_FICASE && isalpha(ch)) {
+        ch = islower(ch) ? toupper(ch) : tolower(ch);
+        set[ch/8] |= 1<<ch%8;
+    }
+}
+
+static int overlaps(const uint8_t* a, const uint8_t* b) {
+    int i;
+    for (i=0; i<32; ++i) if (a[i] & b[i]) return 1;
+    return 0;
+}
+
+static int first_set(rejit_instruction* b, rejit_instruction* e,
+                     rejit_flags flags, uint8_t* set);
+
+// Add the bytes a match of instr can start with to set. Returns whether it can
+// match without consuming anything.
+static int first_one(rejit_instruction* instr, rejit_flags flags,
+                     uint8_t* set) {
+    rejit_instruction* e, *mid;
+    const char* s;
+    char single[256];
+    Rune r;
+    unsigned char u;
+    int empty, i, n;
+
+    switch (instr->kind) {
+    case RJ_IWORD:
+        s = (const char*)instr->value;
+        if (*s) set_add(set, *s, flags);
+        return !*s;
+    case RJ_IDOT:
+        for (i=1; i<256; ++i)
+            if (i != '\n' || flags & RJ_FDOTALL) set_add(set, i, flags);
+        return 0;
+    case RJ_ISET: case RJ_INSET:
+        memset(single, 0, sizeof(single));
+        // Only the first byte of a multibyte member can start a match.
+        for (s = (const char*)instr->value; *s; s += n) {
+            n = chartorune(&r, (char*)s);
+            u = *s;
+            if (instr->kind == RJ_ISET) set_add(set, u, flags);
+            else if (n == 1) {
+                single[u] = 1;
+                if (flags & RJ_FICASE && isalpha(u))
+                    single[islower(u) ? toupper(u) : tolower(u)] = 1;
+            }
+        }
+        if (instr->kind == RJ_INSET)
+            for (i=1; i<256; ++i) if (!single[i]) set_add(set, i, flags);
+        return instr->kind == RJ_INSET;
+    case RJ_IUSET:
+        for (i=1; i<256; ++i) set_add(set, i, flags);
+        return 0;
+    case RJ_IBEGIN: case RJ_IEND: case RJ_ILAHEAD: case RJ_INLAHEAD:
+    case RJ_ILBEHIND: case RJ_INLBEHIND:
+        return 1;
+    case RJ_ISTAR: case RJ_IMSTAR: case RJ_IOPT:
+        first_one(instr+1, flags, set);
+        return 1;
+    case RJ_IPLUS: case RJ_IMPLUS:
+        return first_one(instr+1, flags, set);
+    case RJ_IREP:
+        if (instr->value == 0 && instr->value2 == 0) return 1;
+        return first_one(instr+1, flags, set) || instr->value == 0;
+    case RJ_IGROUP: case RJ_ICGROUP:
+        return first_set(instr+1, (rejit_instruction*)instr->value, flags, set);
+    case RJ_IOR:
+        e = (rejit_instruction*)instr->value2;
+        empty = 0;
+        for (;; instr = mid) {
+            mid = (rejit_instruction*)instr->value;
+            empty |= first_set(instr+1, mid, flags, set);
+            if (!CHAINED(mid, e)) break;
+        }
+        return first_set(mid, e, flags, set) || empty;
+    default:
+        // Backreferences can start with anything, or match nothing.
+        memset(set, 0xff, 32);
+        return 1;
+    }
+}
+
+static int first_set(rejit_instruction* b, rejit_instruction* e,
+                     rejit_flags flags, uint8_t* set) {
+    // Once something has to consume a byte, nothing after it comes first.
+    for (; b != e; b = expr_end(b)) if (!first_one(b, flags, set)) return 0;
+    return 1;
+}
+
+static void analyze(analyze_ctx* c, rejit_instruction* b, rejit_instruction* e,
+                    lits* l, int* forks);
+
+static void analyze_one(analyze_ctx* c, rejit_instruction* instr, lits* l,
+                        int* forks) {
+    rejit_instruction* e, *mid;
+    const char* s;
+    int n, f;
+    lits alt;
+
+    memset(l, 0, sizeof(lits));
+    *forks = 0;
+    switch (instr->kind) {
+    case RJ_IWORD:
+        s = (const char*)instr->value;
+        lits_exact(l, s, strlen(s));
+        break;
+    case RJ_IBACK:
+        c->special = 1;
+        c->res->backrefs = 1;
+        break;
+    case RJ_IBEGIN: case RJ_IEND:
+        c->special = 1;
+        lits_exact(l, "", 0);
+        break;
+    case RJ_ILAHEAD: case RJ_INLAHEAD: case RJ_ILBEHIND: case RJ_INLBEHIND:
+        // Lookarounds only narrow down where the rest can match.
+        c->special = 1;
+        c->res->lookaround = 1;
+        analyze(c, instr+1, (rejit_instruction*)instr->value, l, forks);
+        lits_free(l);
+        lits_exact(l, "", 0);
+        break;
+    case RJ_ISTAR: case RJ_IMSTAR: case RJ_IPLUS: case RJ_IMPLUS: case RJ_IOPT:
+        c->special = 1;
+        analyze_one(c, instr+1, l, forks);
+        ++*forks;
+        if (instr->kind == RJ_IPLUS || instr->kind == RJ_IMPLUS) lits_inexact(l);
+        else lits_free(l);
+        break;
+    case RJ_IREP:
+        c->special = 1;
+        analyze_one(c, instr+1, l, forks);
+        if (instr->value2 > instr->value) ++*forks;
+        if (instr->value == 0) lits_free(l);
+        else lits_inexact(l);
+        break;
+    case RJ_IGROUP: case RJ_ICGROUP:
+        analyze(c, instr+1, (rejit_instruction*)instr->value, l, forks);
+        break;
+    case RJ_IOR:
+        c->special = 1;
+        e = (rejit_instruction*)instr->value2;
+        for (n=0;; instr = mid, ++n) {
+            mid = (rejit_instruction*)instr->value;
+            analyze(c, instr+1, mid, n ? &alt : l, &f);
+            if (n) lits_alt(l, &alt);
+            if (f > *forks) *forks = f;
+            if (!CHAINED(mid, e)) break;
+        }
+        analyze(c, mid, e, &alt, &f);
+        lits_alt(l, &alt);
+        if (f > *forks) *forks = f;
+        // Every alternative but the last leaves a fork behind.
+        *forks += n+1;
+        break;
+    default:
+        c->special = 1;
+        break;
+    }
+}
+
+static void analyze(analyze_ctx* c, rejit_instruction* b, rejit_instruction* e,
+                    lits* l, int* forks) {
+    lits item;
+    int f;
+    lits_exact(l, "", 0);
+    *forks = 0;
+    for (; b != e; b = expr_end(b)) {
+        analyze_one(c, b, &item, &f);
+        lits_seq(l, &item);
+        if (f > *forks) *forks = f;
+    }
+}
+
+#define LOOP(ia) ((ia)->kind == RJ_ISTAR || (ia)->kind == RJ_IMSTAR ||\
+                  (ia)->kind == RJ_IPLUS || (ia)->kind == RJ_IMPLUS ||\
+                  ((ia)->kind == RJ_IREP && (ia)->value2 > (ia)->value))
+
+static rejit_risk risk(rejit_instruction* b, rejit_instruction* e,
+                       rejit_flags flags, uint8_t* tail);
+
+// Whether an iteration ending with b..e can stop at an optional part, like
+// the one left after factoring (a|ab) into a(|b). Stopping there and going on
+// into the next iteration is then a guess.
+static int stops_early(rejit_instruction* b, rejit_instruction* e,
+                       rejit_flags flags) {
+    rejit_instruction* ia, *mid, *end;
+    uint8_t set[32];
+    for (; b != e; b = expr_end(b)) {
+        if (!first_set(expr_end(b), e, flags, set)) continue;
+        switch (b->kind) {
+        case RJ_IOPT: return 1;
+        case RJ_IGROUP: case RJ_ICGROUP:
+            if (stops_early(b+1, (rejit_instruction*)b->value, flags))
+                return 1;
+            break;
+        case RJ_IOR:
+            end = (rejit_instruction*)b->value2;
+            for (ia = b;; ia = mid) {
+                mid = (rejit_instruction*)ia->value;
+                if (first_set(ia+1, mid, flags, set) ||
+                    stops_early(ia+1, mid, flags)) return 1;
+                if (!CHAINED(mid, end)) break;
+            }
+            if (first_set(mid, end, flags, set) ||
+                stops_early(mid, end, flags)) return 1;
+            break;
+        default: break;
+        }
+    }
+    return 0;
+}
+
+// How badly matching instr can backtrack. tail gets the first bytes of the
+// loops a match of instr can end inside of.
+static rejit_risk risk_one(rejit_instruction* instr, rejit_flags flags,
+                           uint8_t* tail) {
+    rejit_instruction* e, *mid, *ia;
+    rejit_risk res = RJ_RNONE, r;
+    uint8_t body[32], inner[32], alts[32], one[32];
+    int n;
+
+    memset(tail, 0, 32);
+    if (instr->kind == RJ_IREP && !LOOP(instr))
+        return risk_one(instr+1, flags, tail);
+    switch (instr->kind) {
+    case RJ_ISTAR: case RJ_IMSTAR: case RJ_IPLUS: case RJ_IMPLUS: case RJ_IREP:
+        memset(body, 0, sizeof(body));
+        first_one(instr+1, flags, body);
+        res = risk_one(instr+1, flags, inner);
+        // An iteration that can end inside a loop taking the same bytes as
+        // the next iteration can split the input in exponentially many ways,
+        // like (a+)+. So can a body that backtracks at all.
+        if (res != RJ_RNONE || overlaps(inner, body)) return RJ_REXP;
+        if (stops_early(instr+1, expr_end(instr+1), flags)) return RJ_REXP;
+        // Alternatives that start alike make every iteration a guess, like
+        // (a|ab)*.
+        for (ia = instr+1; ia->kind == RJ_IGROUP || ia->kind == RJ_ICGROUP;
+             ++ia)
+            if (expr_end(ia+1) != (rejit_instruction*)ia->value) break;
+        if (ia->kind == RJ_IOR) {
+            e = (rejit_instruction*)ia->value2;
+            memset(alts, 0, sizeof(alts));
+            for (;; ia = mid) {
+                mid = (rejit_instruction*)ia->value;
+                memset(one, 0, sizeof(one));
+                first_set(ia+1, mid, flags, one);
+                if (overlaps(one, alts)) return RJ_REXP;
+                for (n=0; n<32; ++n) alts[n] |= one[n];
+                if (!CHAINED(mid, e)) break;
+            }
+            memset(one, 0, sizeof(one));
+            first_set(mid, e, flags, one);
+            if (overlaps(one, alts)) return RJ_REXP;
+        }
+        memcpy(tail, body, sizeof(body));
+        return RJ_RNONE;
+    case RJ_IOPT:
+        return risk_one(instr+1, flags, tail);
+    case RJ_IGROUP: case RJ_ICGROUP: case RJ_ILAHEAD: case RJ_INLAHEAD:
+    case RJ_ILBEHIND: case RJ_INLBEHIND:
+        res = risk(instr+1, (rejit_instruction*)instr->value, flags, tail);
+        // What a lookaround ends in is gone before the next byte.
+        if (instr->kind != RJ_IGROUP && instr->kind != RJ_ICGROUP)
+            memset(tail, 0, 32);
+        return res;
+    case RJ_IOR:
+        e = (rejit_instruction*)instr->value2;
+        for (;; instr = mid) {
+            mid = (rejit_instruction*)instr->value;
+            if ((r = risk(instr+1, mid, flags, one)) > res) res = r;
+            for (n=0; n<32; ++n) tail[n] |= one[n];
+            if (!CHAINED(mid, e)) break;
+        }
+        if ((r = risk(mid, e, flags, one)) > res) res = r;
+        for (n=0; n<32; ++n) tail[n] |= one[n];
+        return res;
+    default: return RJ_RNONE;
+    }
+}
+
+static rejit_risk risk(rejit_instruction* b, rejit_instruction* e,
+                       rejit_flags flags, uint8_t* tail) {
+    rejit_risk res = RJ_RNONE, r;
+    uint8_t one[32], first[32];
+    int n, empty;
+    memset(tail, 0, 32);
+    for (; b != e; b = expr_end(b)) {
+        if ((r = risk_one(b, flags, one)) > res) res = r;
+        memset(first, 0, sizeof(first));
+        empty = first_one(b, flags, first);
+        // A loop right after another one that takes the same bytes, like
+        // a*a*, can split the input between them in many ways.
+        if (LOOP(b) && res < RJ_RPOLY && overlaps(tail, first)) res = RJ_RPOLY;
+        // What the sequence can end inside of is what this can end inside
+        // of, plus what came before if this can be skipped.
+        if (empty) for (n=0; n<32; ++n) tail[n] |= one[n];
+        else memcpy(tail, one, sizeof(one));
+    }
+    return res;
+}
+
+rejit_risk rejit_backtrack_risk(rejit_instruction* instrs, rejit_flags flags) {
+    rejit_instruction* e;
+    uint8_t tail[32];
+    for (e = instrs; e->kind; ++e);
+    return risk(instrs, e, flags, tail);
+}
+
+rejit_analysis rejit_analyze(rejit_parse_result res) {
+    rejit_analysis a;
+    analyze_ctx c;
+    rejit_instruction* e;
+    lits l;
+
+    memset(&a, 0, sizeof(a));
+    c.res = &a;
+    c.special = 0;
+    for (e = res.instrs; e->kind; ++e);
+    rejit_length_bounds(res.instrs, &a.minlen, &a.maxlen);
+    a.anchor = rejit_anchoring(res.instrs);
+    // A match that can be empty can start before any byte.
+    if (first_set(res.instrs, e, res.flags, a.first))
+        memset(a.first, 0xff, sizeof(a.first));
+    a.risk = rejit_backtrack_risk(res.instrs, res.flags);
+    analyze(&c, res.instrs, e, &l, &a.forks);
+
+    a.literal = l.exact && !c.special && l.prelen;
+    lits_inexact(&l);
+    if (l.inlen < l.prelen || l.inlen < l.suflen) {
+        free(l.in);
+        if (l.prelen > l.suflen) l.in = lit_cat(l.pre, l.inlen = l.prelen, "", 0);
+        else l.in = lit_cat(l.suf, l.inlen = l.suflen, "", 0);
+    }
+    a.prefix = lit_end(l.pre, l.prelen);
+    a.suffix = lit_end(l.suf, l.suflen);
+    a.inner = lit_end(l.in, l.inlen);
+    return a;
+}
+
+void rejit_free_analysis(rejit_analysis a) {
+    free(a.prefix);
+    free(a.suffix);
+    free(a.inner);
+}
@@ -0,0 +1,71 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+   License, v. 2.0. If a copy of the MPL was not distributed with this
+   file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "rejit.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct batch_type {
+    const char* const* patterns;
+    size_t n, next, compiled;
+    rejit_flags flags;
+    rejit_matcher* matchers;
+    rejit_parse_error* errs;
+} batch;
+
+// Take patterns one at a time until they run out, so a few slow ones don't
+// hold up the rest.
+static void* batch_worker(void* arg) {
+    batch* b = arg;
+    rejit_compiler* c = rejit_new_compiler();
+    rejit_parse_error err, *e;
+    size_t i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->n) {
+        e = b->errs ? &b->errs[i] : &err;
+        if (c == NULL) {
+            b->matchers[i] = NULL;
+            e->kind = RJ_PE_MEM;
+            e->pos = 0;
+            continue;
+        }
+        b->matchers[i] = rejit_compiler_parse_compile(c, b->patterns[i], e,
+                                                      b->flags);
+        if (b->matchers[i] == NULL) {
+            if (e->kind == RJ_PE_NONE) e->kind = RJ_PE_MEM;
+        } else __atomic_add_fetch(&b->compiled, 1, __ATOMIC_RELAXED);
+    }
+    if (c) rejit_free_compiler(c);
+    return NULL;
+}
+
+size_t rejit_compile_many(const char* const* patterns, size_t n,
+                          rejit_flags flags, int nthreads,
+                          rejit_matcher* matchers, rejit_parse_error* errs) {
+    batch b;
+    pthread_t* threads;
+    int i, started = 0;
+
+    b.patterns = patterns;
+    b.n = n;
+    b.next = b.compiled = 0;
+    b.flags = flags;
+    b.matchers = matchers;
+    b.errs = errs;
+
+    if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((size_t)nthreads > n) nthreads = n;
+    // The calling thread is a worker too, so there's one less to start, and
+    // nothing is lost if starting them fails.
+    if (nthreads > 1 && (threads = malloc(sizeof(pthread_t)*(nthreads-1)))) {
+        for (i=0; i<nthreads-1; ++i)
+            if (pthread_create(&threads[started], NULL, batch_worker, &b) == 0)
+                ++started;
+        batch_worker(&b);
+        for (i=0; i<started; ++i) pthread_join(threads[i], NULL);
+        free(threads);
+    } else batch_worker(&b);
+    return b.compiled;
+}
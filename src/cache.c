@@ -0,0 +1,239 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+   License, v. 2.0. If a copy of the MPL was not distributed with this
+   file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "rejit.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Lookups take no lock. They only read the bucket chains, which writers
+// change under the lock by publishing new heads and unlinking entries without
+// touching their own links. An unlinked entry is retired instead of freed and
+// only freed once no lookup is running in its bucket, so a lookup never reads
+// freed memory.
+//
+// Entries are also kept on a list from most to least recently listed, which
+// only writers touch. Hits just stamp the entry, and eviction moves entries
+// stamped since they were listed back to the front instead of evicting them.
+
+// An evicted entry's refs, so no lookup can take it anymore.
+#define DEAD (-1)
+
+typedef struct rejit_cache_entry_type {
+    struct rejit_cache_entry_type* next, *retired, *newer, *older;
+    rejit_matcher m;
+    uint64_t hash;
+    rejit_flags flags;
+    int refs;
+    // The cache's clock when the entry was last handed out, and when it was
+    // put where it is on the list.
+    unsigned long used, listed;
+    size_t size;
+    char str[];
+} entry;
+
+// Each bucket counts its own lookups, so lookups of different patterns don't
+// fight over one counter. It shares a line with the head they read anyway.
+typedef struct bucket_type {
+    entry* head;
+    int readers;
+} bucket;
+
+struct rejit_cache_type {
+    pthread_mutex_t lock;
+    bucket* buckets;
+    size_t nbuckets, budget, size, count;
+    unsigned long clock;
+    // The ends of the list.
+    entry* newest, *oldest;
+    entry* retired;
+};
+
+static uint64_t hash(const char* str, rejit_flags flags) {
+    uint64_t h = 14695981039346656037ull ^ flags;
+    for (; *str; ++str) h = (h ^ (unsigned char)*str) * 1099511628211ull;
+    return h;
+}
+
+rejit_cache* rejit_new_cache(size_t budget) {
+    rejit_cache* c = malloc(sizeof(rejit_cache));
+    if (c == NULL) return NULL;
+    // Programs take a few hundred bytes, so this keeps chains short without
+    // ever resizing, which lookups couldn't see safely.
+    for (c->nbuckets = 64; c->nbuckets < budget/1024 && c->nbuckets < 1<<20;
+         c->nbuckets *= 2);
+    if ((c->buckets = calloc(c->nbuckets, sizeof(bucket))) == NULL) {
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    c->budget = budget;
+    c->size = c->count = 0;
+    c->clock = 0;
+    c->newest = c->oldest = c->retired = NULL;
+    return c;
+}
+
+static entry* lookup(rejit_cache* c, const char* str, rejit_flags flags,
+                     uint64_t h) {
+    bucket* b = &c->buckets[h & (c->nbuckets-1)];
+    entry* e;
+    int refs;
+    __atomic_add_fetch(&b->readers, 1, __ATOMIC_SEQ_CST);
+    for (e = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE); e;
+         e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE)) {
+        if (e->hash != h || e->flags != flags || strcmp(e->str, str)) continue;
+        refs = __atomic_load_n(&e->refs, __ATOMIC_RELAXED);
+        while (refs != DEAD &&
+               !__atomic_compare_exchange_n(&e->refs, &refs, refs+1, 1,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+        if (refs == DEAD) e = NULL;
+        else __atomic_store_n(&e->used, __atomic_load_n(&c->clock,
+                              __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        break;
+    }
+    __atomic_sub_fetch(&b->readers, 1, __ATOMIC_SEQ_CST);
+    return e;
+}
+
+static void list_remove(rejit_cache* c, entry* e) {
+    if (e->newer) e->newer->older = e->older;
+    else c->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else c->oldest = e->newer;
+}
+
+static void list_push(rejit_cache* c, entry* e) {
+    e->newer = NULL;
+    e->older = c->newest;
+    if (c->newest) c->newest->newer = e;
+    else c->oldest = e;
+    c->newest = e;
+    // Move the clock past it, so hits from now on stamp it newer.
+    e->listed = __atomic_fetch_add(&c->clock, 1, __ATOMIC_RELAXED);
+}
+
+static void unlink_entry(rejit_cache* c, entry* e) {
+    entry** p = &c->buckets[e->hash & (c->nbuckets-1)].head;
+    while (*p != e) p = &(*p)->next;
+    // Sequentially consistent like readers, so reclaim can't read readers
+    // before lookups can see e is gone.
+    __atomic_store_n(p, e->next, __ATOMIC_SEQ_CST);
+    list_remove(c, e);
+    c->size -= e->size;
+    --c->count;
+    e->retired = c->retired;
+    c->retired = e;
+}
+
+// Free what was retired if no lookup could still be looking at it.
+static void reclaim(rejit_cache* c) {
+    entry* e, **p = &c->retired;
+    while ((e = *p) != NULL) {
+        if (__atomic_load_n(&c->buckets[e->hash & (c->nbuckets-1)].readers,
+                            __ATOMIC_SEQ_CST)) {
+            p = &e->retired;
+            continue;
+        }
+        *p = e->retired;
+        rejit_free_matcher(e->m);
+        free(e);
+    }
+}
+
+// Evict the least recently used entries nobody holds until the cache fits its
+// budget again.
+static void evict(rejit_cache* c) {
+    entry* e;
+    // Entries handed out since they were listed go back to the front instead,
+    // and so do held ones. Unless lookups keep hitting them meanwhile, two
+    // passes see everything that can be evicted.
+    size_t visits = 2*c->count;
+    int zero;
+    while (c->size > c->budget && visits--) {
+        e = c->oldest;
+        if (__atomic_load_n(&e->used, __ATOMIC_RELAXED) <= e->listed) {
+            zero = 0;
+            // A lookup may have just taken it.
+            if (__atomic_compare_exchange_n(&e->refs, &zero, DEAD, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                unlink_entry(c, e);
+                continue;
+            }
+        }
+        list_remove(c, e);
+        list_push(c, e);
+    }
+}
+
+rejit_matcher rejit_cache_get(rejit_cache* c, const char* str,
+                              rejit_parse_error* err, rejit_flags flags) {
+    uint64_t h = hash(str, flags);
+    size_t len;
+    entry* e, *found;
+    rejit_matcher m;
+
+    err->kind = RJ_PE_NONE;
+    err->pos = 0;
+    if ((e = lookup(c, str, flags, h)) != NULL) return e->m;
+
+    // Compile without the lock, so other patterns can be compiled meanwhile.
+    if ((m = rejit_parse_compile(str, err, flags)) == NULL) {
+        if (err->kind == RJ_PE_NONE) err->kind = RJ_PE_MEM;
+        return NULL;
+    }
+    len = strlen(str);
+    if ((e = malloc(sizeof(entry)+len+1)) == NULL) {
+        rejit_free_matcher(m);
+        err->kind = RJ_PE_MEM;
+        return NULL;
+    }
+    memcpy(e->str, str, len+1);
+    e->m = m;
+    e->m->entry = e;
+    e->hash = h;
+    e->flags = flags;
+    e->refs = 1;
+    e->size = sizeof(entry)+len+1+sizeof(*m)+m->sz+m->scansz;
+
+    pthread_mutex_lock(&c->lock);
+    // Another thread may have compiled the same pattern first.
+    if ((found = lookup(c, str, flags, h)) != NULL) {
+        pthread_mutex_unlock(&c->lock);
+        rejit_free_matcher(m);
+        free(e);
+        return found->m;
+    }
+    e->used = 0;
+    list_push(c, e);
+    e->next = c->buckets[h & (c->nbuckets-1)].head;
+    __atomic_store_n(&c->buckets[h & (c->nbuckets-1)].head, e,
+                     __ATOMIC_RELEASE);
+    c->size += e->size;
+    ++c->count;
+    evict(c);
+    reclaim(c);
+    pthread_mutex_unlock(&c->lock);
+    return m;
+}
+
+void rejit_cache_release(rejit_cache* c, rejit_matcher m) {
+    __atomic_sub_fetch(&m->entry->refs, 1, __ATOMIC_RELEASE);
+}
+
+void rejit_free_cache(rejit_cache* c) {
+    entry* e, *next;
+    size_t i;
+    reclaim(c);
+    for (i=0; i<c->nbuckets; ++i)
+        for (e = c->buckets[i].head; e; e = next) {
+            next = e->next;
+            rejit_free_matcher(e->m);
+            free(e);
+        }
+    pthread_mutex_destroy(&c->lock);
+    free(c->buckets);
+    free(c);
+}
@@ -0,0 +1,229 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+   License, v. 2.0. If a copy of the MPL was not distributed with this
+   file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define _GNU_SOURCE
+#include "rejit.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Programs are packed into large regions instead of getting a mapping each.
+// Every region is the same memory mapped twice, once writable and once
+// executable, so no page is ever both and matchers already in a region keep
+// running while new ones are written next to them. Build with RJ_HUGEPAGES to
+// ask for regions backed by huge pages.
+
+#define ALIGN 16
+#ifdef RJ_HUGEPAGES
+#define REGION (2<<20)
+#else
+#define REGION (256<<10)
+#endif
+
+// Free space in a region, sorted by offset.
+typedef struct hole_type {
+    struct hole_type* next;
+    size_t at, size;
+} hole;
+
+typedef struct region_type {
+    struct region_type* next;
+    char* rw, *rx;
+    size_t size, used;
+    hole* holes;
+} region;
+
+static struct {
+    pthread_mutex_t lock;
+    region* regions;
+    // Programs that got their own mapping because a region couldn't be made.
+    size_t singles, singlesz;
+} arena = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+static region* region_new(size_t size) {
+    region* r;
+    int fd;
+    if ((r = malloc(sizeof(region))) == NULL) return NULL;
+    if ((r->holes = malloc(sizeof(hole))) == NULL) {
+        free(r);
+        return NULL;
+    }
+    if ((fd = memfd_create("rejit", MFD_CLOEXEC)) == -1) goto fail;
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        goto fail;
+    }
+    r->rw = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    r->rx = mmap(0, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->rw == MAP_FAILED || r->rx == MAP_FAILED) {
+        if (r->rw != MAP_FAILED) munmap(r->rw, size);
+        if (r->rx != MAP_FAILED) munmap(r->rx, size);
+        goto fail;
+    }
+    #if defined(RJ_HUGEPAGES) && defined(MADV_HUGEPAGE)
+    madvise(r->rw, size, MADV_HUGEPAGE);
+    madvise(r->rx, size, MADV_HUGEPAGE);
+    #endif
+    r->size = size;
+    r->used = 0;
+    r->holes->next = NULL;
+    r->holes->at = 0;
+    r->holes->size = size;
+    r->next = arena.regions;
+    arena.regions = r;
+    return r;
+
+fail:
+    free(r->holes);
+    free(r);
+    return NULL;
+}
+
+static void region_free(region* r) {
+    hole* h, *next;
+    for (h = r->holes; h; h = next) {
+        next = h->next;
+        free(h);
+    }
+    munmap(r->rw, r->size);
+    munmap(r->rx, r->size);
+    free(r);
+}
+
+// Take sz bytes from the first hole that fits.
+static void* region_take(region* r, size_t sz, void** rw) {
+    hole** p, *h;
+    size_t at;
+    for (p = &r->holes; (h = *p); p = &h->next) {
+        if (h->size < sz) continue;
+        at = h->at;
+        h->at += sz;
+        h->size -= sz;
+        r->used += sz;
+        if (h->size == 0) {
+            *p = h->next;
+            free(h);
+        }
+        *rw = r->rw+at;
+        return r->rx+at;
+    }
+    return NULL;
+}
+
+void* rejit_code_alloc(size_t sz, void** rw) {
+    region* r;
+    void* res = NULL;
+    size_t page = sysconf(_SC_PAGESIZE);
+    sz = (sz+ALIGN-1) & ~(size_t)(ALIGN-1);
+    pthread_mutex_lock(&arena.lock);
+    #if RJ_X64
+    // 32-bit code holds absolute addresses of its own labels, so it has to be
+    // written where it runs.
+    for (r = arena.regions; r && res == NULL; r = r->next)
+        res = region_take(r, sz, rw);
+    if (res == NULL &&
+        (r = region_new(sz > REGION ? (sz+page-1) & ~(page-1) : REGION)))
+        res = region_take(r, sz, rw);
+    #endif
+    if (res == NULL) {
+        res = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+        if (res == MAP_FAILED) res = NULL;
+        else {
+            *rw = res;
+            ++arena.singles;
+            arena.singlesz += sz;
+        }
+    }
+    pthread_mutex_unlock(&arena.lock);
+    return res;
+}
+
+int rejit_code_seal(void* code, size_t sz) {
+    region* r;
+    pthread_mutex_lock(&arena.lock);
+    for (r = arena.regions; r; r = r->next)
+        if ((char*)code >= r->rx && (char*)code < r->rx+r->size) break;
+    pthread_mutex_unlock(&arena.lock);
+    // Programs in a region are already executable. Hardened hosts can refuse
+    // to make anything else executable.
+    if (r == NULL && mprotect(code, sz, PROT_READ | PROT_EXEC) == -1) return -1;
+    return 0;
+}
+
+void rejit_code_free(void* code, size_t sz) {
+    region** p, *r;
+    hole** hp, *h, *prev = NULL;
+    size_t at;
+    sz = (sz+ALIGN-1) & ~(size_t)(ALIGN-1);
+    pthread_mutex_lock(&arena.lock);
+    for (p = &arena.regions; (r = *p); p = &r->next)
+        if ((char*)code >= r->rx && (char*)code < r->rx+r->size) break;
+    if (r == NULL) {
+        munmap(code, sz);
+        --arena.singles;
+        arena.singlesz -= sz;
+        pthread_mutex_unlock(&arena.lock);
+        return;
+    }
+    r->used -= sz;
+    // Keep one region around even when it's empty, so a program compiled and
+    // freed over and over doesn't map and unmap each time.
+    if (r->used == 0 && (p != &arena.regions || r->next)) {
+        *p = r->next;
+        region_free(r);
+        pthread_mutex_unlock(&arena.lock);
+        return;
+    }
+    at = (char*)code-r->rx;
+    for (hp = &r->holes; (h = *hp) && h->at < at; hp = &h->next) prev = h;
+    // Merge with the holes on either side.
+    if (prev && prev->at+prev->size == at) {
+        prev->size += sz;
+        if (h && at+sz == h->at) {
+            prev->size += h->size;
+            prev->next = h->next;
+            free(h);
+        }
+    } else if (h && at+sz == h->at) {
+        h->at = at;
+        h->size += sz;
+    } else if ((h = malloc(sizeof(hole))) != NULL) {
+        // Without memory for the hole, the space is just never reused.
+        h->at = at;
+        h->size = sz;
+        h->next = *hp;
+        *hp = h;
+    }
+    pthread_mutex_unlock(&arena.lock);
+}
+
+rejit_code_stats rejit_get_code_stats(void) {
+    rejit_code_stats res;
+    region* r;
+    hole* h;
+    memset(&res, 0, sizeof(res));
+    pthread_mutex_lock(&arena.lock);
+    for (r = arena.regions; r; r = r->next) {
+        ++res.regions;
+        res.mapped += r->size;
+        res.used += r->used;
+        for (h = r->holes; h; h = h->next) {
+            res.free += h->size;
+            if (h->size > res.largest) res.largest = h->size;
+        }
+    }
+    res.singles = arena.singles;
+    res.mapped += arena.singlesz;
+    res.used += arena.singlesz;
+    pthread_mutex_unlock(&arena.lock);
+    return res;
+}
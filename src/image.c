@@ -0,0 +1,240 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+   License, v. 2.0. If a copy of the MPL was not distributed with this
+   file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "rejit.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// An image is a header, a record per matcher, the words of word matchers, and
+// then, starting on a page boundary, every program back to back. x86-64
+// programs are position independent apart from their helper tables, so loading
+// one is mapping the file, filling in the tables, and making the code
+// executable.
+
+#define MAGIC "rejitimg"
+#define VERSION 1
+#define ALIGN 16
+
+typedef struct header_type {
+    char magic[8];
+    uint32_t version, ptrsize, features, count;
+    uint64_t code, size;
+} header;
+
+typedef struct record_type {
+    // Offsets into the code. scan == func if the matcher has one program.
+    uint64_t func, scan, sz, scansz, help, scanhelp;
+    int64_t minlen, maxlen;
+    // Offset of the word from the start of the file, or 0.
+    uint64_t word;
+    int32_t groups, flags, anchor, pad;
+} record;
+
+struct rejit_image_type {
+    void* base;
+    size_t size;
+    struct rejit_matcher_type* structs;
+    rejit_matcher* matchers;
+};
+
+// The CPU features the code may use. An image only loads where all of the ones
+// present when it was saved are present too.
+static uint32_t cpu_features(void) {
+    uint32_t res = 0;
+    #if defined(__GNUC__) && (RJ_X86 || RJ_X64)
+    __builtin_cpu_init();
+    res |= !!__builtin_cpu_supports("popcnt") << 0;
+    res |= !!__builtin_cpu_supports("sse4.2") << 1;
+    res |= !!__builtin_cpu_supports("avx2") << 2;
+    res |= !!__builtin_cpu_supports("bmi2") << 3;
+    #endif
+    return res;
+}
+
+static size_t align(size_t n, size_t a) { return (n+a-1) / a * a; }
+
+int rejit_save_image(const char* path, rejit_matcher* matchers, size_t n) {
+    header h;
+    record* recs;
+    FILE* f;
+    size_t i, at, page = sysconf(_SC_PAGESIZE);
+    int ok;
+
+    #if !RJ_X64
+    // 32-bit programs hold absolute addresses of their own labels.
+    return -1;
+    #endif
+    // Only machine code can be saved, and profiled code points at counters.
+    for (i=0; i<n; ++i)
+        if ((!matchers[i]->word && !matchers[i]->sz) ||
+            matchers[i]->flags & RJ_FPROFILE)
+            return -1;
+    if ((recs = calloc(n ? n : 1, sizeof(record))) == NULL) return -1;
+    memcpy(h.magic, MAGIC, sizeof(h.magic));
+    h.version = VERSION;
+    h.ptrsize = sizeof(void*);
+    h.features = cpu_features();
+    h.count = n;
+
+    at = sizeof(header)+n*sizeof(record);
+    for (i=0; i<n; ++i) {
+        rejit_matcher m = matchers[i];
+        if (!m->word) continue;
+        recs[i].word = at;
+        at += strlen(m->word)+1;
+    }
+    h.code = align(at, page);
+    at = 0;
+    for (i=0; i<n; ++i) {
+        rejit_matcher m = matchers[i];
+        recs[i].minlen = m->minlen;
+        recs[i].maxlen = m->maxlen;
+        recs[i].groups = m->groups;
+        recs[i].flags = m->flags;
+        recs[i].anchor = m->anchor;
+        if (m->word) continue;
+        recs[i].func = recs[i].scan = at;
+        recs[i].sz = m->sz;
+        recs[i].help = m->help;
+        at = align(at+m->sz, ALIGN);
+        if (m->scan != m->func) {
+            recs[i].scan = at;
+            recs[i].scansz = m->scansz;
+            recs[i].scanhelp = m->scanhelp;
+            at = align(at+m->scansz, ALIGN);
+        }
+    }
+    h.size = h.code+align(at, page);
+
+    if ((f = fopen(path, "wb")) == NULL) {
+        free(recs);
+        return -1;
+    }
+    ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+         fwrite(recs, sizeof(record), n, f) == n;
+    for (i=0; i<n && ok; ++i)
+        if (matchers[i]->word)
+            ok = fputs(matchers[i]->word, f) != EOF && fputc(0, f) != EOF;
+    for (i=0; i<n && ok; ++i) {
+        rejit_matcher m = matchers[i];
+        if (m->word) continue;
+        ok = fseek(f, h.code+recs[i].func, SEEK_SET) == 0 &&
+             fwrite((void*)m->func, 1, m->sz, f) == m->sz;
+        if (ok && m->scan != m->func)
+            ok = fseek(f, h.code+recs[i].scan, SEEK_SET) == 0 &&
+                 fwrite((void*)m->scan, 1, m->scansz, f) == m->scansz;
+    }
+    // Pad the file out to its full size, so it can all be mapped.
+    if (ok && h.size > h.code)
+        ok = fseek(f, h.size-1, SEEK_SET) == 0 && fputc(0, f) != EOF;
+    if (fclose(f) != 0) ok = 0;
+    free(recs);
+    return ok ? 0 : -1;
+}
+
+// Whether a program lies within the code and so does its helper table.
+static int program_ok(header* h, uint64_t at, uint64_t sz, uint64_t help) {
+    uint64_t codesz = h->size-h->code;
+    return at <= codesz && sz <= codesz-at &&
+           (!help || (help < sz && sz-help >= 4*sizeof(void*)));
+}
+
+static int record_ok(header* h, record* r) {
+    if (r->word)
+        return r->word < h->code &&
+               memchr((char*)h+r->word, 0, h->code-r->word) != NULL;
+    return program_ok(h, r->func, r->sz, r->help) &&
+           (r->scan == r->func || program_ok(h, r->scan, r->scansz,
+                                             r->scanhelp));
+}
+
+rejit_image* rejit_load_image(const char* path, rejit_matcher** matchers,
+                              size_t* n) {
+    rejit_image* img;
+    header* h;
+    record* recs;
+    struct stat st;
+    char* base, *code;
+    size_t i, page = sysconf(_SC_PAGESIZE);
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return NULL;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(header)) {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    h = (header*)base;
+    recs = (record*)(h+1);
+    if (memcmp(h->magic, MAGIC, sizeof(h->magic)) || h->version != VERSION ||
+        h->ptrsize != sizeof(void*) || h->features & ~cpu_features() ||
+        h->size != (uint64_t)st.st_size || h->code % page ||
+        h->code > h->size ||
+        h->count > (h->code-sizeof(header))/sizeof(record))
+        goto fail;
+    for (i=0; i<h->count; ++i) if (!record_ok(h, &recs[i])) goto fail;
+
+    if ((img = malloc(sizeof(rejit_image))) == NULL) goto fail;
+    img->structs = calloc(h->count ? h->count : 1, sizeof(*img->structs));
+    img->matchers = malloc((h->count ? h->count : 1)*sizeof(rejit_matcher));
+    if (img->structs == NULL || img->matchers == NULL) {
+        free(img->structs);
+        free(img->matchers);
+        free(img);
+        goto fail;
+    }
+    img->base = base;
+    img->size = st.st_size;
+
+    code = base+h->code;
+    for (i=0; i<h->count; ++i) {
+        rejit_matcher m = img->matchers[i] = &img->structs[i];
+        m->minlen = recs[i].minlen;
+        m->maxlen = recs[i].maxlen;
+        m->groups = recs[i].groups;
+        m->flags = recs[i].flags;
+        m->anchor = recs[i].anchor;
+        m->image = img;
+        if (recs[i].word) {
+            m->word = base+recs[i].word;
+            continue;
+        }
+        m->func = (rejit_func)(code+recs[i].func);
+        m->scan = (rejit_func)(code+recs[i].scan);
+        m->sz = recs[i].sz;
+        m->scansz = recs[i].scansz;
+        m->help = recs[i].help;
+        m->scanhelp = recs[i].scanhelp;
+        if (m->help) rejit_fill_helpers(code+recs[i].func+m->help);
+        if (recs[i].scan != recs[i].func && m->scanhelp)
+            rejit_fill_helpers(code+recs[i].scan+m->scanhelp);
+    }
+    if (h->size > h->code &&
+        mprotect(code, h->size-h->code, PROT_READ | PROT_EXEC) == -1) {
+        rejit_free_image(img);
+        return NULL;
+    }
+    *matchers = img->matchers;
+    *n = h->count;
+    return img;
+
+fail:
+    munmap(base, st.st_size);
+    return NULL;
+}
+
+void rejit_free_image(rejit_image* img) {
+    munmap(img->base, img->size);
+    free(img->structs);
+    free(img->matchers);
+    free(img);
+}
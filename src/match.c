@@ -6,10 +6,43 @@
 
 #include <sys/mman.h>
 #include <assert.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <pthread.h>
+
+// The encoder's buffers come from the allocator of the compiler they belong
+// to. ctx is the compiler's dasm_State**, which is its first field.
+#define DASM_BY(ctx) (&((rejit_compiler*)(ctx))->by)
+#define DASM_M_GROW(ctx, t, p, sz, need) do {\
+    size_t grow_sz = (sz), grow_need = (need);\
+    if (grow_sz < grow_need) {\
+        t* grow_p;\
+        if (grow_sz < 16) grow_sz = 16;\
+        while (grow_sz < grow_need) grow_sz += grow_sz;\
+        if ((grow_p = rejit_alloc(DASM_BY(ctx), grow_sz)) == NULL) exit(1);\
+        if (p) {\
+            memcpy(grow_p, (p), (sz));\
+            rejit_free(DASM_BY(ctx), (p));\
+        }\
+        (p) = grow_p;\
+        (sz) = grow_sz;\
+    }\
+} while (0)
+#define DASM_M_FREE(ctx, p, sz) rejit_free(DASM_BY(ctx), (p))
+
 #include "dynasm/dasm_proto.h"
+
+struct rejit_compiler_type {
+    dasm_State* d;
+    // rejit_compile_instrs makes a compiler for each call, which uses the
+    // thread's allocator. One from rejit_new_compiler outlives that, so it uses
+    // malloc.
+    rejit_allocator by;
+    // What the program being compiled is profiled by, if it is.
+    struct profile_type* prof;
+};
 #include "utf/utf.h"
 
 #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
@@ -18,64 +51,90 @@
 
 #define MAXSZ 100
 
-static void compile_one(dasm_State**, rejit_instruction*, int, int*, int, int,
+static void compile_one(dasm_State**, rejit_instruction*, int, int*, int,
                         rejit_flags);
 
-#define GROW dasm_growpc(Dst, ++*pcl)
+// The table is sized up front by count_labels, so this rarely has to grow it.
+#define GROW do {\
+    if ((size_t)++*pcl*sizeof(int) > (*Dst)->pcsize) dasm_growpc(Dst, *pcl);\
+} while (0)
+
+// Drop the loops that end the pattern. Only used internally, for the program
+// that looks for where a match starts.
+#define SHORTEST (1<<16)
 
-static int genmagic(char* s, char* min, size_t* len, rj_word* magic, int icase) {
-    int done=1, prev=0;
-    char* b = s;
+// Put the single bytes of the set s that lie within a word's bits of the
+// smallest one left into magic, as offsets from min, and mark them as done in
+// the type bytes that follow s. Multibyte characters are marked 'W' and 'U'
+// there instead, on the first call. Returns 0 once nothing is left.
+static int genmagic(char* s, int first, unsigned char* min, size_t* len,
+                    rj_word* magic, int icase) {
+    int done=1, fits, diff, j, rl;
+    char* b = s, *x;
+    unsigned char c;
     Rune r;
-    // Get minimum.
-    if (*min) {
-        *min = 0;
-        prev = 1;
-        for (b=s; *s; ++s) {
-            char c = *s, x = b[*len+(s-b)+1];
-            if (!x && (!*min || c < *min)) *min = c;
-        }
-        if (!*min) return 0;
-    } else {
-        *min = *s;
-        for (b=s; *s; ++s) {
-            // Uppercase chars always have a lower ASCII value than lowercase.
-            char c = icase ? toupper(*s) : *s;
-            if (c < *min) *min = c;
-        }
-    }
-    *len = s-b;
+    if (first) *len = strlen(s);
+    // Get minimum. Uppercase chars always have a lower ASCII value than
+    // lowercase.
+    *min = 0;
+    for (; *s; s += rl) {
+        rl = chartorune(&r, s);
+        c = icase ? toupper((unsigned char)*s) : (unsigned char)*s;
+        if (rl == 1 && (first || !b[*len+(s-b)+1]) && (!*min || c < *min))
+            *min = c;
+    }
+    if (!first && !*min) return 0;
     *magic = 0;
-    for (s=b; *s; ++s) {
-        int j, rl = chartorune(&r, s);
-        if (rl > 1) {
-            int i;
-            b[*len+(s-b)+1] = 'W';
-            for (i=1; i<rl; ++i) {
-                b[*len+(s-b+i)+1] = 'U';
-            }
-            s += rl-1;
+    for (s=b; *s; s += rl) {
+        x = &b[*len+(s-b)+1];
+        if ((rl = chartorune(&r, s)) > 1) {
+            if (!first) continue;
+            *x = 'W';
+            for (j=1; j<rl; ++j) x[j] = 'U';
             done = 0;
             continue;
         }
-        for (j=0; j<(icase?2:1); ++j) {
-            int diff;
-            char c = *s, *x = &b[*len+(s-b)+1];
-            if (prev && *x) continue;
+        if (!first && *x) continue;
+        for (fits=1, j=0; j<(icase?2:1); ++j) {
+            c = *s;
             if (icase) c = j ? toupper(c) : tolower(c);
             diff = c-*min;
-            if (diff > sizeof(unsigned long)*8-1) *x = 0;
+            if (diff < 0 || diff > (int)sizeof(rj_word)*8-1) fits = 0;
             else {
-                *magic |= 1lu<<diff;
+                *magic |= (rj_word)1<<diff;
                 done = 0;
-                *x = 1;
             }
         }
+        // A char whose cases didn't both fit is left for a later call.
+        *x = fits;
     }
 
     return !done;
 }
 
+// Return one past the last instruction of the expression starting at instr.
+static rejit_instruction* expr_end(rejit_instruction* instr) {
+    rejit_instr_kind kind = instr->kind;
+    if (kind > RJ_ISKIP) kind -= RJ_ISKIP;
+    if (kind == RJ_IOR) return (rejit_instruction*)instr->value2;
+    else if (kind > RJ_IVARG) return (rejit_instruction*)instr->value;
+    else if (kind > RJ_IARG) return expr_end(instr+1);
+    else return instr+1;
+}
+
+static int range_len(rejit_instruction* parent, rejit_instruction* begin,
+                     rejit_instruction* end) {
+    rejit_instruction* ia;
+    int a, len = 0;
+    for (ia = begin; ia != end; ia = expr_end(ia)) {
+        a = rejit_match_len(ia);
+        ia->len_from = parent;
+        if (a == -1) len = -1;
+        else if (len != -1) len += a;
+    }
+    return len;
+}
+
 int rejit_match_len(rejit_instruction* instr) {
     rejit_instruction* ia;
     int a=0, b=0;
@@ -96,20 +155,11 @@ int rejit_match_len(rejit_instruction* instr) {
     case RJ_ILAHEAD: case RJ_INLAHEAD: case RJ_ILBEHIND: case RJ_INLBEHIND:
     case RJ_IBEGIN: case RJ_IEND: return 0;
     case RJ_IGROUP: case RJ_ICGROUP:
-        for (ia = instr+1; ia != (rejit_instruction*)instr->value; ++ia) {
-            a += rejit_match_len(ia);
-            ia->len_from = instr;
-        }
-        return a;
+        return range_len(instr, instr+1, (rejit_instruction*)instr->value);
     case RJ_IOR:
-        for (ia = instr+1; ia != (rejit_instruction*)instr->value; ++ia) {
-            a += rejit_match_len(ia);
-            ia->len_from = instr;
-        }
-        for (; ia != (rejit_instruction*)instr->value2; ++ia) {
-            b += rejit_match_len(ia);
-            ia->len_from = instr;
-        }
+        a = range_len(instr, instr+1, (rejit_instruction*)instr->value);
+        b = range_len(instr, (rejit_instruction*)instr->value,
+                      (rejit_instruction*)instr->value2);
         return a == b ? a : -1;
     case RJ_IBACK: return -1; // XXX
     case RJ_INULL: case RJ_ISKIP: case RJ_IARG: case RJ_IVARG:
@@ -121,6 +171,289 @@ int rejit_match_len(rejit_instruction* instr) {
     abort();
 }
 
+// The byte an alternative has to start with, or -1 if it is not known.
+static int alt_first(rejit_instruction* b, rejit_instruction* e,
+                     rejit_flags flags) {
+    unsigned char c;
+    if (b == e || b->kind != RJ_IWORD) return -1;
+    c = *(char*)b->value;
+    if (!c || (flags & RJ_FICASE && isalpha(c))) return -1;
+    return c;
+}
+
+// Whether ia continues the RJ_IOR chain a|(b|(c|...)) that ends at e.
+#define CHAINED(ia,e) ((ia) != (e) && (ia)->kind == RJ_IOR &&\
+                       (rejit_instruction*)(ia)->value2 == (e))
+
+// The first bytes of the alternatives of an RJ_IOR chain that haven't been
+// compiled yet. After an alternative has matched its first byte, the rest only
+// need to be forked to if one of them could start with that byte too.
+typedef struct alt_bytes_type {
+    size_t unknown, n[256];
+} alt_bytes;
+
+static void count_alt(alt_bytes* ab, int c, int d) {
+    if (c == -1) ab->unknown += d;
+    else ab->n[c] += d;
+}
+
+static alt_bytes* count_alts(rejit_instruction* instr, rejit_flags flags) {
+    rejit_instruction* e = (rejit_instruction*)instr->value2, *mid;
+    alt_bytes* ab = rejit_alloc(NULL, sizeof(alt_bytes));
+    if (ab == NULL) return NULL;
+    memset(ab, 0, sizeof(alt_bytes));
+    for (;; instr = mid) {
+        mid = (rejit_instruction*)instr->value;
+        count_alt(ab, alt_first(instr+1, mid, flags), 1);
+        if (!CHAINED(mid, e)) {
+            count_alt(ab, alt_first(mid, e, flags), 1);
+            break;
+        }
+    }
+    return ab;
+}
+
+// A profiled program counts which alternative of each RJ_IOR chain it takes
+// and which word of each set matched, so it can be compiled again with the
+// likeliest ones tried first. Instruction i's counters start at slot[i]: an
+// RJ_IOR has one for the alternative on its left and one for the one on its
+// right if that ends the chain, and a set has one per word, which is at most
+// one per character.
+typedef struct profile_type {
+    rejit_instruction* instrs;
+    size_t* slot;
+    unsigned long* counts;
+    // Whether to count, or to use what was counted.
+    int counting;
+} profile;
+
+#define PROF(Dst) (((rejit_compiler*)(Dst))->prof)
+
+static int start_profile(profile* p, rejit_instruction* instrs) {
+    size_t i, n = 0;
+    for (i=0; instrs[i].kind; ++i);
+    if ((p->slot = malloc((i+1)*sizeof(size_t))) == NULL) return -1;
+    for (i=0; instrs[i].kind; ++i) {
+        p->slot[i] = n;
+        if (instrs[i].kind == RJ_IOR) n += 2;
+        else if (instrs[i].kind == RJ_ISET || instrs[i].kind == RJ_INSET)
+            n += strlen((char*)instrs[i].value);
+    }
+    if ((p->counts = calloc(n ? n : 1, sizeof(unsigned long))) == NULL) {
+        free(p->slot);
+        p->slot = NULL;
+        return -1;
+    }
+    p->instrs = instrs;
+    p->counting = 1;
+    return 0;
+}
+
+// The programs may still be counting on other threads.
+static unsigned long counted(profile* p, rejit_instruction* instr, int n) {
+    return __atomic_load_n(&p->counts[p->slot[instr-p->instrs]+n],
+                           __ATOMIC_RELAXED);
+}
+
+// An alternative of an RJ_IOR chain, from b to e. It's counted by ior's left
+// counter, or its right one if right is set.
+typedef struct alt_type {
+    rejit_instruction* b, *e, *ior;
+    int right, first, next;
+    unsigned long n;
+} alt;
+
+// The order to try the alternatives of a profiled RJ_IOR chain in, ending with
+// one whose b is NULL, or NULL to try them as written. Only alternatives that
+// can match at the same position have to keep their order, so each time, this
+// takes the one taken most often that doesn't have to wait for another. That
+// is the first of those starting with its byte, if it starts with a known one
+// and no alternative starting with an unknown one is left before it.
+static alt* order_alts(profile* p, rejit_instruction* instr,
+                       rejit_flags flags) {
+    rejit_instruction* e = (rejit_instruction*)instr->value2, *mid;
+    alt* alts, *res;
+    int head[256], i, j, k, n, from, to, best;
+    if (p == NULL || p->counting) return NULL;
+    for (n=2, mid = instr; CHAINED((rejit_instruction*)mid->value, e);
+         mid = (rejit_instruction*)mid->value, ++n);
+    if ((alts = rejit_alloc(NULL, (2*n+1)*sizeof(alt))) == NULL) return NULL;
+    res = alts+n;
+    for (i=0;; ++i, instr = mid) {
+        mid = (rejit_instruction*)instr->value;
+        alts[i].b = instr+1;
+        alts[i].e = mid;
+        alts[i].ior = instr;
+        alts[i].right = 0;
+        if (!CHAINED(mid, e)) break;
+    }
+    alts[n-1].b = mid;
+    alts[n-1].e = e;
+    alts[n-1].ior = instr;
+    alts[n-1].right = 1;
+    for (i=0; i<n; ++i) {
+        alts[i].first = alt_first(alts[i].b, alts[i].e, flags);
+        alts[i].n = counted(p, alts[i].ior, alts[i].right);
+    }
+    // Alternatives that start with unknown bytes stay where they are, and
+    // split the rest into runs that are merged from a queue per byte.
+    for (from=k=0; from<n; from=to+1) {
+        for (to=from; to<n && alts[to].first != -1; ++to);
+        for (j=0; j<256; ++j) head[j] = -1;
+        for (i=to-1; i>=from; --i) {
+            j = alts[i].first;
+            alts[i].next = head[j];
+            head[j] = i;
+        }
+        for (i=from; i<to; ++i) {
+            for (best=-1, j=0; j<256; ++j)
+                if (head[j] != -1 && (best == -1 ||
+                    alts[head[j]].n > alts[head[best]].n ||
+                    (alts[head[j]].n == alts[head[best]].n &&
+                     head[j] < head[best])))
+                    best = j;
+            res[k++] = alts[head[best]];
+            head[best] = alts[head[best]].next;
+        }
+        if (to < n) res[k++] = alts[to];
+    }
+    res[n].b = NULL;
+    memmove(alts, res, (n+1)*sizeof(alt));
+    return alts;
+}
+
+// The order to test the n words of a set in: the ones that matched most first.
+static void order_chunks(profile* p, rejit_instruction* instr, int* order,
+                         int n) {
+    int i, k;
+    for (i=0; i<n; ++i) {
+        k = i;
+        if (p != NULL && !p->counting)
+            for (; k > 0 && counted(p, instr, order[k-1]) <
+                            counted(p, instr, i); --k)
+                order[k] = order[k-1];
+        order[k] = i;
+    }
+}
+
+static long fixed_len(rejit_instruction* instr);
+
+// Whether every member of the set s is a single byte. UTF-8 members take as
+// many bytes as they're written with.
+static int single_bytes(char* s) {
+    Rune r;
+    int rl;
+    for (; *s; s += rl) if ((rl = chartorune(&r, s)) > 1) return 0;
+    return 1;
+}
+
+static long fixed_range_len(rejit_instruction* b, rejit_instruction* e) {
+    long len = 0, a;
+    for (; b != e; b = expr_end(b)) {
+        if ((a = fixed_len(b)) == -1) return -1;
+        len += a;
+    }
+    return len;
+}
+
+// The length of every match of instr, or -1 if it can vary. Unlike
+// rejit_match_len, this doesn't touch the instructions, works on ones that were
+// already compiled, and takes [^x] as variable: it matches the end of the input
+// without consuming anything. So is a set with multibyte members. Groups have
+// to be measured first.
+static long fixed_len(rejit_instruction* instr) {
+    rejit_instruction* e, *mid;
+    rejit_instr_kind kind = instr->kind;
+    long a, b;
+    if (kind > RJ_ISKIP) kind -= RJ_ISKIP;
+    switch (kind) {
+    case RJ_IWORD: return strlen((char*)instr->value);
+    case RJ_ISET: return single_bytes((char*)instr->value) ? 1 : -1;
+    case RJ_IDOT: return 1;
+    case RJ_IBEGIN: case RJ_IEND: case RJ_ILAHEAD: case RJ_INLAHEAD:
+    case RJ_ILBEHIND: case RJ_INLBEHIND:
+        return 0;
+    case RJ_IREP:
+        if (instr->value != instr->value2 || (a = fixed_len(instr+1)) == -1)
+            return -1;
+        return a * instr->value;
+    case RJ_IGROUP: case RJ_ICGROUP: return (long)instr->len;
+    case RJ_IOR:
+        e = (rejit_instruction*)instr->value2;
+        for (a = -1;; instr = mid) {
+            mid = (rejit_instruction*)instr->value;
+            b = fixed_range_len(instr+1, mid);
+            if (b == -1 || (a != -1 && a != b)) return -1;
+            a = b;
+            if (!CHAINED(mid, e)) break;
+        }
+        return fixed_range_len(mid, e) == a ? a : -1;
+    default: return -1;
+    }
+}
+
+// How far a lookbehind steps back, from the lengths the parser gave its direct
+// children, or -1 if that isn't fixed.
+static long lookbehind_len(rejit_instruction* instr) {
+    rejit_instruction* ia, *ib = (rejit_instruction*)instr->value;
+    long len = 0;
+    for (ia = instr+1; ia != ib; ++ia) {
+        if (ia->len_from && ia->len_from != instr) continue;
+        else if ((long)ia->len == -1) return -1;
+        else len += ia->len;
+    }
+    return len;
+}
+
+// Whether a group has to save the position it started at. Fixed-length groups
+// can work it out from where they end, and lookbehinds end where they started.
+// Negative lookarounds still need it to undo a partial match.
+static int saves(rejit_instruction* instr) {
+    rejit_instr_kind kind = instr->kind;
+    if (kind > RJ_ISKIP) kind -= RJ_ISKIP;
+    switch (kind) {
+    case RJ_IGROUP: case RJ_ICGROUP: return (long)instr->len == -1;
+    case RJ_ILAHEAD:
+        return fixed_range_len(instr+1, (rejit_instruction*)instr->value) == -1;
+    case RJ_ILBEHIND: return lookbehind_len(instr) == -1;
+    default: return 1;
+    }
+}
+
+static int measure(rejit_instruction* b, rejit_instruction* e, int lb);
+
+static int measure_one(rejit_instruction* instr, int lb) {
+    rejit_instruction* e, *mid;
+    int n = 0, d;
+    if (instr->kind == RJ_IOR) {
+        e = (rejit_instruction*)instr->value2;
+        for (;; instr = mid) {
+            mid = (rejit_instruction*)instr->value;
+            if ((d = measure(instr+1, mid, lb)) > n) n = d;
+            if (!CHAINED(mid, e)) break;
+        }
+        return (d = measure(mid, e, lb)) > n ? d : n;
+    } else if (instr->kind > RJ_IVARG) {
+        e = (rejit_instruction*)instr->value;
+        n = measure(instr+1, e, lb || instr->kind == RJ_ILBEHIND ||
+                                instr->kind == RJ_INLBEHIND);
+        if (!lb && (instr->kind == RJ_IGROUP || instr->kind == RJ_ICGROUP))
+            instr->len = fixed_range_len(instr+1, e);
+        return n + saves(instr);
+    } else if (instr->kind > RJ_IARG) return measure_one(instr+1, lb);
+    else return 0;
+}
+
+// Store the fixed length of each group in its len field, and return how many
+// save slots deep the groups nest. Inside lookbehinds (lb), the lengths from
+// the parser are kept, since the lookbehind adds them up.
+static int measure(rejit_instruction* b, rejit_instruction* e, int lb) {
+    int n = 0, d;
+    for (; b != e; b = expr_end(b))
+        if ((d = measure_one(b, lb)) > n) n = d;
+    return n;
+}
+
 static void unskip(rejit_instruction* instr) {
     rejit_instruction* i;
     if (instr->kind > RJ_ISKIP) instr->kind -= RJ_ISKIP;
@@ -139,75 +472,1709 @@ static void skip(rejit_instruction* instr) {
 
 #include "codegen.c"
 
-static void* link_and_encode(dasm_State** d, size_t* sz) {
-    void* buf;
+void rejit_fill_helpers(void* table) {
+    void* helpers[] = {(void*)chartorune, (void*)isspacerune,
+                       (void*)isdigitrune, (void*)isalnumrune};
+    memcpy(table, helpers, sizeof(helpers));
+}
+
+// Whether the program calls any C functions, and so needs compile_helpers.
+static int calls_helpers(rejit_instruction* instrs) {
+    for (; instrs->kind; ++instrs) if (instrs->kind == RJ_IUSET) return 1;
+    return 0;
+}
+
+static void* link_and_encode(dasm_State** d, size_t* sz, void** labels,
+                             size_t* help) {
+    void* buf, *rw;
     #ifdef DEBUG
     FILE* f;
     #endif
     dasm_link(d, sz);
-    buf = mmap(0, *sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
-               0);
-    dasm_encode(d, buf);
+    if ((buf = rejit_code_alloc(*sz, &rw)) == NULL) return NULL;
+    dasm_encode(d, rw);
+    *help = 0;
+    #if RJ_X64
+    if (labels[lbl_call_chartorune]) {
+        *help = (char*)labels[lbl_call_chartorune]-(char*)rw;
+        rejit_fill_helpers(labels[lbl_call_chartorune]);
+    }
+    #endif
     #ifdef DEBUG
     f = fopen("/tmp/.rejit.dis", "w");
     if (f) {
-        fwrite(buf, 1, *sz, f);
+        fwrite(rw, 1, *sz, f);
         fclose(f);
     }
     #endif
-    mprotect(buf, *sz, PROT_READ | PROT_EXEC);
+    if (rejit_code_seal(buf, *sz) == -1) {
+        rejit_code_free(buf, *sz);
+        return NULL;
+    }
     return buf;
 }
 
-static rejit_func compile(dasm_State** d, size_t* sz, rejit_instruction* instrs,
-                          int maxdepth, rejit_flags flags) {
-    int i;
+// The loop at the very end of b..e, looking into groups, or NULL if there isn't
+// one. Once everything before it has matched, such a loop can only make the
+// match longer.
+static rejit_instruction* tail_loop(rejit_instruction* b, rejit_instruction* e) {
+    rejit_instruction* last = NULL;
+    for (; b != e; b = expr_end(b)) if (b->kind < RJ_ISKIP) last = b;
+    if (last == NULL) return NULL;
+    switch (last->kind) {
+    case RJ_ISTAR: case RJ_IMSTAR: case RJ_IOPT: return last;
+    case RJ_IREP: return last->value == 0 ? last : NULL;
+    case RJ_IGROUP: case RJ_ICGROUP:
+        return tail_loop(last+1, (rejit_instruction*)last->value);
+    default: return NULL;
+    }
+}
+
+// About how many labels compile_one makes for instrs. Case-insensitive words
+// take one per letter, and nothing else takes more than a few.
+static int count_labels(rejit_instruction* instrs, rejit_flags flags) {
+    int n = 2;
+    for (; instrs->kind; ++instrs)
+        if (instrs->kind == RJ_IWORD && flags & RJ_FICASE)
+            n += strlen((char*)instrs->value);
+        else n += 4;
+    return n;
+}
+
+static rejit_func compile(rejit_compiler* c, size_t* sz, size_t* help,
+                          rejit_instruction* instrs, int groups, int maxdepth,
+                          rejit_flags flags, profile* prof) {
+    dasm_State** d = &c->d;
+    int i, nlabels;
     void* labels[lbl__MAX];
+    rejit_instruction* ia, *ib;
+    for (i=0; instrs[i].kind; ++i);
+    // Only groups that save need a slot.
+    if ((i = measure(instrs, &instrs[i], 0)) < maxdepth) maxdepth = i;
+    if (flags & SHORTEST) {
+        for (i=0; instrs[i].kind; ++i);
+        while ((ia = tail_loop(instrs, &instrs[i])))
+            for (ib = expr_end(ia); ia != ib; ++ia) skip(ia);
+    }
+    // Label 0 backtracks, and 1+i puts back save slot i.
+    int pcl=1+maxdepth;
+    nlabels = pcl+count_labels(instrs, flags);
+    // dasm_setup clears the whole table, so don't let one huge pattern make
+    // every later compile pay for it.
+    if ((*d)->pcsize > 64*1024 && (*d)->pcsize/sizeof(int) > (size_t)nlabels*4) {
+        DASM_M_FREE(d, (*d)->pclabels, (*d)->pcsize);
+        (*d)->pclabels = NULL;
+        (*d)->pcsize = 0;
+    }
+    memset(labels, 0, sizeof(labels));
+    c->prof = prof;
     dasm_setupglobal(d, labels, lbl__MAX);
     dasm_setup(d, actions);
-
-    int pcl=1;
-    dasm_growpc(d, 1);
+    dasm_growpc(d, nlabels);
 
     compile_prolog(d, maxdepth);
+    compile_clear(d, instrs, groups, flags);
     for (i=0; instrs[i].kind; ++i)
-        compile_one(d, &instrs[i], 0, &pcl, 0, maxdepth, flags);
+        compile_one(d, &instrs[i], 0, &pcl, 0, flags);
     compile_epilog(d, &pcl, maxdepth);
+    // Leave the instructions as they were, so they can be compiled again.
+    for (i=0; instrs[i].kind; ++i)
+        if (instrs[i].kind > RJ_ISKIP) instrs[i].kind -= RJ_ISKIP;
+    if (calls_helpers(instrs)) compile_helpers(d);
+
+    return link_and_encode(d, sz, labels, help);
+}
+
+// Whether the match depends on the groups written so far, so it can't run
+// without them.
+static int reads_groups(rejit_instruction* instrs) {
+    for (; instrs->kind; ++instrs) if (instrs->kind == RJ_IBACK) return 1;
+    return 0;
+}
+
+// A pattern that is just a word is matched by comparing strings, so it gets no
+// program.
+static rejit_matcher compile_word(const char* word, rejit_flags flags) {
+    size_t len = strlen(word);
+    rejit_matcher res = malloc(sizeof(struct rejit_matcher_type)+len+1);
+    if (!res) return NULL;
+    memset(res, 0, sizeof(struct rejit_matcher_type));
+    res->word = memcpy(res+1, word, len+1);
+    res->flags = flags;
+    res->minlen = res->maxlen = len;
+    return res;
+}
 
-    return link_and_encode(d, sz);
+rejit_matcher rejit_static_matcher(const rejit_static* s) {
+    rejit_matcher res = malloc(sizeof(struct rejit_matcher_type));
+    if (!res) return NULL;
+    memset(res, 0, sizeof(struct rejit_matcher_type));
+    // sz stays 0, which tells rejit_free_matcher there's no code to free.
+    res->func = s->func;
+    res->scan = s->scan;
+    res->groups = s->groups;
+    res->flags = s->flags;
+    res->anchor = s->anchor;
+    res->minlen = s->minlen;
+    res->maxlen = s->maxlen;
+    res->word = (char*)s->word;
+    return res;
+}
+
+static int word_at(rejit_matcher m, const char* str) {
+    size_t i;
+    if (!(m->flags & RJ_FICASE)) return strncmp(str, m->word, m->maxlen) == 0;
+    for (i=0; i<(size_t)m->maxlen; ++i)
+        if (tolower((unsigned char)str[i]) != tolower((unsigned char)m->word[i]))
+            return 0;
+    return 1;
+}
+
+static const char* find_word(rejit_matcher m, const char* str) {
+    char first[3] = {0};
+    if (!(m->flags & RJ_FICASE)) return strstr(str, m->word);
+    first[0] = tolower((unsigned char)*m->word);
+    first[1] = toupper((unsigned char)*m->word);
+    for (;; ++str) {
+        str += strcspn(str, first);
+        if (!*str) return NULL;
+        if (word_at(m, str)) return str;
+    }
+}
+
+rejit_compiler* rejit_new_compiler(void) {
+    rejit_compiler* c = malloc(sizeof(rejit_compiler));
+    if (c == NULL) return NULL;
+    memset(&c->by, 0, sizeof(c->by));
+    dasm_init(&c->d, DASM_MAXSECTION);
+    return c;
+}
+
+void rejit_free_compiler(rejit_compiler* c) {
+    dasm_free(&c->d);
+    free(c);
 }
 
 rejit_matcher rejit_compile_instrs(rejit_instruction* instrs, int groups,
                                    int maxdepth, rejit_flags flags) {
-    rejit_func func;
+    rejit_compiler c;
     rejit_matcher res;
-    size_t sz;
-    dasm_State* d;
-    dasm_init(&d, DASM_MAXSECTION);
-    func = compile(&d, &sz, instrs, maxdepth, flags);
-    dasm_free(&d);
-    res = malloc(sizeof(struct rejit_matcher_type));
-    if (!res) return NULL;
+    c.by = rejit_get_allocator();
+    dasm_init(&c.d, DASM_MAXSECTION);
+    res = rejit_compiler_compile_instrs(&c, instrs, groups, maxdepth, flags);
+    dasm_free(&c.d);
+    return res;
+}
+
+// Compile to machine code, once the flags have been settled. Returns NULL if
+// the code couldn't be made executable, so it can be interpreted instead.
+static rejit_matcher compile_jit(rejit_compiler* c, rejit_instruction* instrs,
+                                 int groups, int maxdepth, rejit_flags flags,
+                                 profile* prof) {
+    rejit_func func, scan;
+    rejit_matcher res;
+    size_t sz, scansz = 0, help, scanhelp = 0;
+    int n;
+    for (n=0; instrs[n].kind; ++n);
+    func = compile(c, &sz, &help, instrs, groups, maxdepth, flags, prof);
+    if (func == NULL) return NULL;
+    scan = func;
+    if (!reads_groups(instrs) && (groups || tail_loop(instrs, &instrs[n])) &&
+        (scan = compile(c, &scansz, &scanhelp, instrs, groups, maxdepth,
+                        flags | RJ_FNOCAPTURE | SHORTEST, prof)) == NULL) {
+        rejit_code_free(func, sz);
+        return NULL;
+    }
+    if ((res = malloc(sizeof(struct rejit_matcher_type))) == NULL) {
+        if (scan != func) rejit_code_free(scan, scansz);
+        rejit_code_free(func, sz);
+        return NULL;
+    }
     res->func = func;
+    res->scan = scan;
     res->sz = sz;
+    res->scansz = scansz;
+    res->help = help;
+    res->scanhelp = scan == func ? help : scanhelp;
+    res->image = NULL;
+    res->interp = NULL;
+    res->groups = groups;
+    res->flags = flags;
+    res->word = NULL;
+    res->entry = NULL;
+    res->anchor = rejit_anchoring(instrs);
+    rejit_length_bounds(instrs, &res->minlen, &res->maxlen);
+    return res;
+}
+
+static rejit_matcher interpreted(rejit_instruction* instrs, int groups,
+                                 int maxdepth, rejit_flags flags);
+static rejit_matcher profiled(rejit_compiler* c, rejit_instruction* instrs,
+                              int groups, int maxdepth, rejit_flags flags);
+
+rejit_matcher rejit_compiler_compile_instrs(rejit_compiler* c,
+                                            rejit_instruction* instrs,
+                                            int groups, int maxdepth,
+                                            rejit_flags flags) {
+    rejit_matcher res = NULL;
+    if (instrs[0].kind == RJ_IWORD && instrs[1].kind == RJ_INULL &&
+        *(char*)instrs[0].value)
+        return compile_word((char*)instrs[0].value, flags);
+    if (reads_groups(instrs)) flags &= ~RJ_FNOCAPTURE;
+    else if (flags & RJ_FNOCAPTURE) groups = 0;
+    if (!(flags & RJ_FLAZY) && flags & RJ_FPROFILE)
+        res = profiled(c, instrs, groups, maxdepth, flags);
+    if (!(flags & RJ_FLAZY) && res == NULL)
+        res = compile_jit(c, instrs, groups, maxdepth, flags, NULL);
+    return res ? res : interpreted(instrs, groups, maxdepth, flags);
+}
+
+// Matchers can also be interpreted, so the first matches don't wait for the
+// JIT, and so patterns still work where code can't be made executable. The
+// programs are laid out like compile_one's, as ops that the interpreter
+// dispatches on through a table of labels, with the same labels, threads, and
+// save slots. Each program is assembled twice, the first time to find where
+// the labels land and how big it is.
+
+enum {
+    OP_FAIL, OP_RESTORE, OP_MATCH, OP_JMP, OP_FORK, OP_FORKSLOT, OP_SAVE,
+    OP_LOAD, OP_BAIL, OP_WORD, OP_IWORD, OP_DOT, OP_DOTALL, OP_BEGIN, OP_END,
+    OP_STOP, OP_BACK, OP_BACK32, OP_SET, OP_NSET, OP_USET, OP_CHAR, OP_BEHIND,
+    OP_BACKUP, OP_CAPTURE, OP_CAPTURE32, OP_CLEAR, OP_CLEAR32
+};
+
+typedef struct program_type {
+    // The ops, then the words and sets they use. NULL if there's no program.
+    int* code;
+    unsigned char* data;
+    int entry, maxdepth;
+} program;
+
+typedef struct assembler_type {
+    // NULL on the first pass.
+    int* code;
+    unsigned char* data;
+    int* labels;
+    size_t n, ndata, cap, datacap;
+    int nlabels, failed;
+} assembler;
+
+static void put(assembler* a, int v) {
+    if (a->code) {
+        if (a->n < a->cap) a->code[a->n] = v;
+        else a->failed = 1;
+    }
+    ++a->n;
+}
+
+// Put an op and its n operands.
+static void op(assembler* a, int code, int n, ...) {
+    va_list args;
+    put(a, code);
+    va_start(args, n);
+    while (n--) put(a, va_arg(args, int));
+    va_end(args);
+}
+
+// Add len bytes to the data and return where they start.
+static int store(assembler* a, const void* p, size_t len) {
+    size_t at = a->ndata;
+    if (a->data) {
+        if (at+len <= a->datacap) memcpy(a->data+at, p, len);
+        else a->failed = 1;
+    }
+    a->ndata += len;
+    return at;
+}
+
+static void place(assembler* a, int l) {
+    int* labels;
+    int n;
+    if (l >= a->nlabels) {
+        for (n = a->nlabels ? a->nlabels*2 : 64; n <= l; n *= 2);
+        if ((labels = rejit_alloc(NULL, n*sizeof(int))) == NULL) {
+            a->failed = 1;
+            return;
+        }
+        memset(labels, 0, n*sizeof(int));
+        if (a->labels) memcpy(labels, a->labels, a->nlabels*sizeof(int));
+        rejit_free(NULL, a->labels);
+        a->labels = labels;
+        a->nlabels = n;
+    }
+    a->labels[l] = a->n;
+}
+
+// Where label l is. Labels that haven't been placed on the first pass are 0,
+// which doesn't matter since nothing is written then.
+static int at(assembler* a, int l) {
+    return l < a->nlabels ? a->labels[l] : 0;
+}
+
+static void asm_bail(assembler* a, rejit_instruction* ia, int errpc,
+                     int saved) {
+    if (ia->kind < RJ_IGROUP || ia->kind > RJ_INLBEHIND) return;
+    if (saves(ia)) op(a, OP_BAIL, 2, saved, at(a, errpc));
+    else if (fixed_len(ia) == 0) op(a, OP_JMP, 1, at(a, errpc));
+}
+
+static void asm_stop(assembler* a, rejit_instruction* ia, int l) {
+    if (ia->kind == RJ_INSET) op(a, OP_STOP, 1, at(a, l));
+}
+
+static void asm_one(assembler* a, rejit_instruction* instr, int errpc,
+                    int* pcl, int saved, rejit_flags flags) {
+    rejit_instruction* ia, *ib, *ic;
+    alt_bytes* ab;
+    unsigned char set[32], c;
+    char* s, *p;
+    int bk, nx, i, j, rl, neg;
+    long len;
+    Rune r;
+    if (instr->kind > RJ_ISKIP) return;
+    switch (instr->kind) {
+    case RJ_ISKIP: printf("RJ_ISKIP was added to RJ_INULL\n"); abort();
+    case RJ_IWORD:
+        s = (char*)instr->value;
+        if ((len = strlen(s)) == 0) break;
+        i = store(a, s, len);
+        if (flags & RJ_FICASE) {
+            if (a->data && !a->failed)
+                for (j=0; j<len; ++j) a->data[i+j] = tolower(a->data[i+j]);
+            op(a, OP_IWORD, 3, (int)len, i, at(a, errpc));
+        } else op(a, OP_WORD, 3, (int)len, i, at(a, errpc));
+        break;
+    case RJ_ISTAR:
+    case RJ_IPLUS:
+    case RJ_IOPT:
+        ia = instr+1;
+        bk = *pcl;
+        *pcl += 2;
+        place(a, bk);
+        if (instr->kind == RJ_ISTAR) asm_stop(a, ia, bk+1);
+        if (instr->kind != RJ_IPLUS) op(a, OP_FORK, 1, at(a, bk+1));
+        asm_one(a, ia, errpc, pcl, saved, flags);
+        asm_bail(a, ia, errpc, saved);
+        if (instr->kind == RJ_IPLUS) {
+            asm_stop(a, ia, bk+1);
+            op(a, OP_FORK, 1, at(a, bk+1));
+        }
+        if (instr->kind != RJ_IOPT) op(a, OP_JMP, 1, at(a, bk));
+        place(a, bk+1);
+        skip(ia);
+        break;
+    case RJ_IREP:
+        ia = instr+1;
+        for (i=0; i<instr->value; ++i) {
+            asm_one(a, ia, errpc, pcl, saved, flags);
+            unskip(ia);
+        }
+        bk = (*pcl)++;
+        for (i=instr->value; i<instr->value2; ++i) {
+            op(a, OP_FORK, 1, at(a, bk));
+            asm_one(a, ia, errpc, pcl, saved, flags);
+            unskip(ia);
+        }
+        place(a, bk);
+        skip(ia);
+        break;
+    case RJ_IMSTAR:
+    case RJ_IMPLUS:
+        ia = instr+1;
+        bk = *pcl;
+        *pcl += 3;
+        if (instr->kind == RJ_IMSTAR) op(a, OP_JMP, 1, at(a, bk+1));
+        place(a, bk);
+        asm_one(a, ia, errpc, pcl, saved, flags);
+        asm_bail(a, ia, errpc, saved);
+        place(a, bk+1);
+        asm_stop(a, ia, bk+2);
+        skip(ia);
+        op(a, OP_FORK, 1, at(a, bk));
+        place(a, bk+2);
+        break;
+    case RJ_IDOT:
+        op(a, flags & RJ_FDOTALL ? OP_DOTALL : OP_DOT, 1, at(a, errpc));
+        break;
+    case RJ_IBEGIN: op(a, OP_BEGIN, 1, at(a, errpc)); break;
+    case RJ_IEND: op(a, OP_END, 1, at(a, errpc)); break;
+    case RJ_IBACK:
+        op(a, flags & RJ_FSPAN32 ? OP_BACK32 : OP_BACK, 2, (int)instr->value,
+           at(a, errpc));
+        break;
+    case RJ_ISET:
+    case RJ_INSET:
+        // A table of the single bytes, as in rejit_emit_c, followed by each
+        // multibyte character with its length in front, and a 0.
+        s = (char*)instr->value;
+        memset(set, 0, sizeof(set));
+        for (p = s; *p; p += rl) {
+            if ((rl = chartorune(&r, p)) > 1) continue;
+            for (j=0; j<(flags & RJ_FICASE ? 2 : 1); ++j) {
+                c = *p;
+                if (flags & RJ_FICASE) c = j ? toupper(c) : tolower(c);
+                set[c>>3] |= 1<<(c&7);
+            }
+        }
+        i = store(a, set, sizeof(set));
+        for (p = s; *p; p += rl) {
+            if ((rl = chartorune(&r, p)) == 1) continue;
+            c = rl;
+            store(a, &c, 1);
+            store(a, p, rl);
+        }
+        c = 0;
+        store(a, &c, 1);
+        op(a, instr->kind == RJ_INSET ? OP_NSET : OP_SET, 2, i, at(a, errpc));
+        break;
+    case RJ_IUSET:
+        op(a, OP_USET, 3, (int)instr->value, (int)instr->value2,
+           at(a, errpc));
+        break;
+    case RJ_IOR:
+        ic = (rejit_instruction*)instr->value2;
+        // Without the counts, the second pass would fork more than the first
+        // made room for.
+        if ((ab = count_alts(instr, flags)) == NULL) a->failed = 1;
+        bk = (*pcl)++;
+        for (;;) {
+            ia = instr+1;
+            ib = (rejit_instruction*)instr->value;
+            nx = (*pcl)++;
+            i = alt_first(ia, ib, flags);
+            if (ab) count_alt(ab, i, -1);
+            if (i != -1) op(a, OP_CHAR, 2, i, at(a, nx));
+            if (i == -1 || !ab || ab->unknown || ab->n[i])
+                op(a, OP_FORK, 1, at(a, nx));
+            for (; ia != ib; ia = expr_end(ia)) {
+                asm_one(a, ia, errpc, pcl, saved, flags);
+                skip(ia);
+            }
+            op(a, OP_JMP, 1, at(a, bk));
+            place(a, nx);
+            if (!CHAINED(ib, ic)) break;
+            instr = ib;
+            skip(instr);
+        }
+        rejit_free(NULL, ab);
+        for (ia = ib; ia != ic; ia = expr_end(ia)) {
+            asm_one(a, ia, errpc, pcl, saved, flags);
+            skip(ia);
+        }
+        place(a, bk);
+        break;
+    case RJ_ICGROUP:
+    case RJ_IGROUP:
+    case RJ_ILAHEAD:
+    case RJ_INLAHEAD:
+    case RJ_ILBEHIND:
+    case RJ_INLBEHIND:
+        neg = instr->kind == RJ_INLAHEAD || instr->kind == RJ_INLBEHIND;
+        bk = *pcl;
+        *pcl += 2;
+        ia = instr+1;
+        ib = (rejit_instruction*)instr->value;
+        len = 0;
+        if (instr->kind == RJ_ILAHEAD) len = fixed_range_len(ia, ib);
+        else if (instr->kind == RJ_ILBEHIND || instr->kind == RJ_INLBEHIND)
+            len = lookbehind_len(instr);
+        i = saves(instr);
+        if (i) {
+            op(a, OP_FORKSLOT, 2, saved, at(a, 1+saved));
+            op(a, OP_SAVE, 1, saved);
+        }
+        if ((instr->kind == RJ_ILBEHIND || instr->kind == RJ_INLBEHIND) &&
+            len > 0)
+            op(a, OP_BEHIND, 2, (int)len, at(a, bk));
+        for (; ia != ib; ia = expr_end(ia)) {
+            asm_one(a, ia, bk, pcl, saved+i, flags);
+            skip(ia);
+        }
+        if (neg) {
+            op(a, OP_LOAD, 1, saved);
+            op(a, OP_JMP, 1, at(a, errpc));
+        } else op(a, OP_JMP, 1, at(a, bk+1));
+        place(a, bk);
+        if (i) op(a, OP_LOAD, 1, saved);
+        if (!neg) {
+            op(a, OP_JMP, 1, at(a, errpc));
+            place(a, bk+1);
+        }
+
+        if (instr->kind == RJ_ILAHEAD || instr->kind == RJ_ILBEHIND) {
+            if (i) op(a, OP_LOAD, 1, saved);
+            else if (instr->kind == RJ_ILAHEAD && len)
+                op(a, OP_BACKUP, 1, (int)len);
+        }
+
+        if (instr->kind == RJ_ICGROUP && !(flags & RJ_FNOCAPTURE))
+            op(a, flags & RJ_FSPAN32 ? OP_CAPTURE32 : OP_CAPTURE, 3,
+               (int)instr->value2, i ? saved : -1, (int)instr->len);
+        break;
+    default: printf("unrecognized opcode: %d\n", instr->kind); abort();
+    }
+}
+
+static void asm_program(assembler* a, program* p, rejit_instruction* instrs,
+                        int groups, int maxdepth, rejit_flags flags) {
+    rejit_instruction* ia, *ib;
+    int i, pcl;
+    for (i=0; instrs[i].kind; ++i);
+    if ((i = measure(instrs, &instrs[i], 0)) < maxdepth) maxdepth = i;
+    if (flags & SHORTEST) {
+        for (i=0; instrs[i].kind; ++i);
+        while ((ia = tail_loop(instrs, &instrs[i])))
+            for (ib = expr_end(ia); ia != ib; ++ia) skip(ia);
+    }
+    // Label 0 backtracks, and 1+i puts back save slot i. They come first, and
+    // the program starts after them.
+    pcl = 1+maxdepth;
+    place(a, 0);
+    op(a, OP_FAIL, 0);
+    for (i=0; i<maxdepth; ++i) {
+        place(a, 1+i);
+        op(a, OP_RESTORE, 1, i);
+    }
+    p->entry = a->n;
+    p->maxdepth = maxdepth;
+    // Clear the groups that backreferences read, as compile_clear does.
+    for (ia = instrs; ia->kind; ++ia) {
+        if (ia->kind != RJ_IBACK || ia->value < 0 || ia->value >= groups)
+            continue;
+        for (ib = instrs; ib != ia; ++ib)
+            if (ib->kind == RJ_IBACK && ib->value == ia->value) break;
+        if (ib == ia)
+            op(a, flags & RJ_FSPAN32 ? OP_CLEAR32 : OP_CLEAR, 1,
+               (int)ia->value);
+    }
+    for (i=0; instrs[i].kind; ++i) asm_one(a, &instrs[i], 0, &pcl, 0, flags);
+    op(a, OP_MATCH, 0);
+    for (i=0; instrs[i].kind; ++i)
+        if (instrs[i].kind > RJ_ISKIP) instrs[i].kind -= RJ_ISKIP;
+}
+
+static int assemble(program* p, rejit_instruction* instrs, int groups,
+                    int maxdepth, rejit_flags flags) {
+    assembler a;
+    memset(&a, 0, sizeof(a));
+    asm_program(&a, p, instrs, groups, maxdepth, flags);
+    p->code = NULL;
+    if (!a.failed && (p->code = malloc(a.n*sizeof(int)+a.ndata)) != NULL) {
+        a.code = p->code;
+        a.data = p->data = (unsigned char*)(p->code+a.n);
+        a.cap = a.n;
+        a.datacap = a.ndata;
+        a.n = a.ndata = 0;
+        asm_program(&a, p, instrs, groups, maxdepth, flags);
+    }
+    rejit_free(NULL, a.labels);
+    if (a.failed || p->code == NULL) {
+        free(p->code);
+        p->code = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct ithread_type {
+    const char* str;
+    int pc;
+} ithread;
+
+#define STACK 64
+
+// Move the threads to the heap, or to a bigger block of it.
+static int grow(ithread** stk, ithread** tp, ithread** end, ithread* stk0) {
+    size_t n = *end-*stk, used = *tp-*stk;
+    ithread* p = malloc(2*n*sizeof(ithread));
+    if (p == NULL) return 0;
+    memcpy(p, *stk, used*sizeof(ithread));
+    if (*stk != stk0) free(*stk);
+    *stk = p;
+    *tp = p+used;
+    *end = p+2*n;
+    return 1;
+}
+
+static long interpret(const program* p, const char* str, void* groups) {
+    static const void* const ops[] = {
+        [OP_FAIL] = &&fail, [OP_RESTORE] = &&restore, [OP_MATCH] = &&match,
+        [OP_JMP] = &&jmp, [OP_FORK] = &&fork, [OP_FORKSLOT] = &&forkslot,
+        [OP_SAVE] = &&save, [OP_LOAD] = &&load, [OP_BAIL] = &&bail,
+        [OP_WORD] = &&word, [OP_IWORD] = &&iword, [OP_DOT] = &&dot,
+        [OP_DOTALL] = &&dotall, [OP_BEGIN] = &&begin, [OP_END] = &&end,
+        [OP_STOP] = &&stop, [OP_BACK] = &&back, [OP_BACK32] = &&back32,
+        [OP_SET] = &&set, [OP_NSET] = &&nset, [OP_USET] = &&uset,
+        [OP_CHAR] = &&chr, [OP_BEHIND] = &&behind, [OP_BACKUP] = &&backup,
+        [OP_CAPTURE] = &&capture, [OP_CAPTURE32] = &&capture32,
+        [OP_CLEAR] = &&clear, [OP_CLEAR32] = &&clear32,
+    };
+    const int* code = p->code, *pc = code+p->entry;
+    const unsigned char* data = p->data, *s;
+    const char* const sav = str, *slot[p->maxdepth+1], *from;
+    rejit_group* g = groups;
+    rejit_span32* sp = groups;
+    ithread stk0[STACK], *stk = stk0, *tp = stk0, *stkend = stk0+STACK;
+    unsigned char c;
+    long res, i, n;
+    Rune r;
+    memset(slot, 0, sizeof(slot));
+
+    // Each op jumps straight to the next one's label.
+    #define NEXT(n) do { pc += (n); goto *ops[*pc]; } while (0)
+    #define GO(l) do { pc = code+(l); goto *ops[*pc]; } while (0)
+    #define PUSH(s, l) do {\
+        if (tp == stkend && !grow(&stk, &tp, &stkend, stk0)) {\
+            res = -1;\
+            goto done;\
+        }\
+        tp->str = (s);\
+        tp->pc = (l);\
+        ++tp;\
+    } while (0)
+    NEXT(0);
+fail:
+    if (tp == stk) {
+        res = -1;
+        goto done;
+    }
+    str = (--tp)->str;
+    GO(tp->pc);
+restore:
+    // Undo a save: the old value was just loaded into str.
+    slot[pc[1]] = str;
+    GO(0);
+match:
+    res = str-sav;
+    goto done;
+jmp:
+    GO(pc[1]);
+fork:
+    PUSH(str, pc[1]);
+    NEXT(2);
+forkslot:
+    PUSH(slot[pc[1]], pc[2]);
+    NEXT(3);
+save:
+    slot[pc[1]] = str;
+    NEXT(2);
+load:
+    str = slot[pc[1]];
+    NEXT(2);
+bail:
+    if (str == slot[pc[1]]) GO(pc[2]);
+    NEXT(3);
+word:
+    if (strncmp(str, (const char*)data+pc[2], pc[1])) GO(pc[3]);
+    str += pc[1];
+    NEXT(4);
+iword:
+    // A mismatch on the terminating NUL stops it reading further.
+    for (i=0, s=data+pc[2]; i<pc[1]; ++i)
+        if (tolower((unsigned char)str[i]) != s[i]) GO(pc[3]);
+    str += pc[1];
+    NEXT(4);
+dot:
+    if (!*str || *str == '\n') GO(pc[1]);
+    ++str;
+    NEXT(2);
+dotall:
+    if (!*str) GO(pc[1]);
+    ++str;
+    NEXT(2);
+begin:
+    if (str != sav) GO(pc[1]);
+    NEXT(2);
+end:
+    if (*str) GO(pc[1]);
+    NEXT(2);
+stop:
+    if (!*str) GO(pc[1]);
+    NEXT(2);
+back:
+    // An empty or unset group never matches, as in compile_one.
+    from = g[pc[1]].begin;
+    n = g[pc[1]].end-from;
+    if (!n || strncmp(str, from, n)) GO(pc[2]);
+    str += n;
+    NEXT(3);
+back32:
+    from = sav+sp[pc[1]].begin;
+    n = (uint32_t)(sp[pc[1]].end-sp[pc[1]].begin);
+    if (!n || strncmp(str, from, n)) GO(pc[2]);
+    str += n;
+    NEXT(3);
+set:
+    s = data+pc[1];
+    for (c = *str, s += 32; *s; s += 1+*s)
+        if (!strncmp(str, (const char*)s+1, *s)) {
+            str += *s;
+            NEXT(3);
+        }
+    s = data+pc[1];
+    if (!(s[c>>3] & 1<<(c&7))) GO(pc[2]);
+    ++str;
+    NEXT(3);
+nset:
+    if (!(c = *str)) NEXT(3);
+    for (s = data+pc[1]+32; *s; s += 1+*s)
+        if (!strncmp(str, (const char*)s+1, *s)) GO(pc[2]);
+    s = data+pc[1];
+    if (s[c>>3] & 1<<(c&7)) GO(pc[2]);
+    ++str;
+    NEXT(3);
+uset:
+    if (!*str) GO(pc[3]);
+    str += chartorune(&r, (char*)str);
+    switch (pc[1]) {
+    case 's': i = !!isspacerune(r); break;
+    case 'd': i = !!isdigitrune(r); break;
+    default: i = isalnumrune(r) || r == '_'; break;
+    }
+    // pc[2] is set for the negated classes.
+    if (i == !!pc[2]) GO(pc[3]);
+    NEXT(4);
+chr:
+    if ((unsigned char)*str != pc[1]) GO(pc[2]);
+    NEXT(3);
+behind:
+    if (str-sav < pc[1]) GO(pc[2]);
+    str -= pc[1];
+    NEXT(3);
+backup:
+    str -= pc[1];
+    NEXT(2);
+capture:
+    g[pc[1]].begin = pc[2] == -1 ? str-pc[3] : slot[pc[2]];
+    g[pc[1]].end = str;
+    NEXT(4);
+capture32:
+    sp[pc[1]].begin = (pc[2] == -1 ? str-pc[3] : slot[pc[2]])-sav;
+    sp[pc[1]].end = str-sav;
+    NEXT(4);
+clear:
+    g[pc[1]].begin = g[pc[1]].end = NULL;
+    NEXT(2);
+clear32:
+    sp[pc[1]].begin = sp[pc[1]].end = RJ_SPAN_NONE;
+    NEXT(2);
+done:
+    if (stk != stk0) free(stk);
+    return res;
+    #undef NEXT
+    #undef GO
+    #undef PUSH
+}
+
+// An interpreted matcher is compiled on another thread once its programs have
+// run this many times, and a profiled one is compiled again once they've run
+// PROFILED times.
+#define HOT 256
+#define PROFILED (HOT*64)
+
+// What an interpreted or profiled matcher's next compile is up to. ORPHANED
+// means the matcher was freed while it was being compiled, and the compiling
+// thread frees the rest.
+enum { COLD, COMPILING, DONE, ORPHANED };
+
+typedef struct rejit_interp_type {
+    pthread_mutex_t lock;
+    rejit_matcher m;
+    // Empty if the matcher was compiled straight away.
+    program func, scan;
+    // A copy of what was interpreted or profiled, to compile. NULL if it
+    // won't be.
+    rejit_instruction* instrs;
+    int groups, maxdepth, state, scans;
+    rejit_flags flags;
+    unsigned long runs;
+    profile prof;
+    // The code a profiled matcher ran before it was compiled again, which
+    // other threads may still be running.
+    struct rejit_matcher_type old;
+} interp;
+
+// Copy instructions along with the strings they point to, so they outlive the
+// parse result they came from.
+static rejit_instruction* copy_instrs(rejit_instruction* instrs) {
+    rejit_instruction* res, *ia;
+    size_t n, len, sz = 0;
+    char* p;
+    for (ia = instrs; ia->kind; ++ia)
+        if (ia->kind == RJ_IWORD || ia->kind == RJ_ISET ||
+            ia->kind == RJ_INSET)
+            // Sets have room for their type bytes after them.
+            sz += 2*strlen((char*)ia->value)+2;
+    n = ia-instrs+1;
+    if ((res = malloc(n*sizeof(rejit_instruction)+sz)) == NULL) return NULL;
+    memcpy(res, instrs, n*sizeof(rejit_instruction));
+    p = (char*)(res+n);
+    #define MOVE(f) ((intptr_t)(res+((rejit_instruction*)(f)-instrs)))
+    for (ia = res; ia->kind; ++ia) {
+        if (ia->kind > RJ_IVARG) ia->value = MOVE(ia->value);
+        if (ia->kind == RJ_IOR) ia->value2 = MOVE(ia->value2);
+        if (ia->len_from) ia->len_from = (rejit_instruction*)MOVE(ia->len_from);
+        if (ia->kind == RJ_IWORD || ia->kind == RJ_ISET ||
+            ia->kind == RJ_INSET) {
+            len = strlen((char*)ia->value);
+            memcpy(p, (char*)ia->value, len+1);
+            memset(p+len+1, 0, len+1);
+            ia->value = (intptr_t)p;
+            p += 2*len+2;
+        }
+    }
+    #undef MOVE
+    return res;
+}
+
+static void free_code(rejit_matcher m) {
+    if (m->scan != m->func) rejit_code_free(m->scan, m->scansz);
+    rejit_code_free(m->func, m->sz);
+}
+
+static void free_interp(interp* ip) {
+    pthread_mutex_destroy(&ip->lock);
+    free(ip->func.code);
+    free(ip->scan.code);
+    free(ip->instrs);
+    free(ip->prof.slot);
+    free(ip->prof.counts);
+    if (ip->old.sz) free_code(&ip->old);
+    free(ip);
+}
+
+// Compile an interpreted matcher, profiled if it's meant to be unless final is
+// set, or compile a profiled one again by what it counted. Then switch it over
+// to the new code. Returns -1 if compiling failed.
+static int recompile(interp* ip, int final) {
+    rejit_compiler c;
+    rejit_matcher j, m;
+    profile* p = NULL;
+    int counting = 0;
+    if (ip->prof.counts) {
+        p = &ip->prof;
+        p->counting = 0;
+    } else if (ip->flags & RJ_FPROFILE && !final &&
+               start_profile(&ip->prof, ip->instrs) == 0) {
+        p = &ip->prof;
+        counting = 1;
+    }
+    c.by = rejit_get_allocator();
+    dasm_init(&c.d, DASM_MAXSECTION);
+    j = compile_jit(&c, ip->instrs, ip->groups, ip->maxdepth, ip->flags, p);
+    dasm_free(&c.d);
+    pthread_mutex_lock(&ip->lock);
+    if (ip->state == ORPHANED) {
+        pthread_mutex_unlock(&ip->lock);
+        if (j) rejit_free_matcher(j);
+        free_interp(ip);
+        return -1;
+    }
+    if (j) {
+        // Each program is used as soon as it's set, and what ran before is
+        // used until then.
+        m = ip->m;
+        if (m->sz) ip->old = *m;
+        m->sz = j->sz;
+        m->scansz = j->scansz;
+        m->help = j->help;
+        m->scanhelp = j->scanhelp;
+        __atomic_store_n(&m->scan, j->scan, __ATOMIC_RELEASE);
+        __atomic_store_n(&m->func, j->func, __ATOMIC_RELEASE);
+        free(j);
+    }
+    // Profiled code gets to run as long as compiled code waits to be.
+    ip->state = j && counting ? COLD : DONE;
+    if (j && counting) __atomic_store_n(&ip->runs, HOT, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ip->lock);
+    return j ? 0 : -1;
+}
+
+static void* warm_up(void* arg) {
+    recompile(arg, 0);
+    return NULL;
+}
+
+static void heat(interp* ip, unsigned long runs) {
+    pthread_attr_t attr;
+    pthread_t t;
+    pthread_mutex_lock(&ip->lock);
+    // Profiled code has to run longer to have counted much.
+    if (ip->state == COLD && (runs == PROFILED || ip->prof.counts == NULL)) {
+        ip->state = DONE;
+        if (pthread_attr_init(&attr) == 0) {
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&t, &attr, warm_up, ip) == 0)
+                ip->state = COMPILING;
+            pthread_attr_destroy(&attr);
+        }
+    }
+    pthread_mutex_unlock(&ip->lock);
+}
+
+static rejit_matcher interpreted(rejit_instruction* instrs, int groups,
+                                 int maxdepth, rejit_flags flags) {
+    rejit_matcher res = malloc(sizeof(struct rejit_matcher_type));
+    interp* ip = malloc(sizeof(interp));
+    int n;
+    if (!res || !ip) {
+        free(res);
+        free(ip);
+        return NULL;
+    }
+    memset(res, 0, sizeof(struct rejit_matcher_type));
+    memset(ip, 0, sizeof(interp));
+    for (n=0; instrs[n].kind; ++n);
+    if (assemble(&ip->func, instrs, groups, maxdepth, flags) == -1) goto fail;
+    if (!reads_groups(instrs) && (groups || tail_loop(instrs, &instrs[n])) &&
+        assemble(&ip->scan, instrs, groups, maxdepth,
+                 flags | RJ_FNOCAPTURE | SHORTEST) == -1)
+        goto fail;
+    // Without RJ_FLAZY, it's only interpreted because compiling failed.
+    if (flags & RJ_FLAZY) {
+        if ((ip->instrs = copy_instrs(instrs)) == NULL) goto fail;
+        ip->state = COLD;
+    } else ip->state = DONE;
+    pthread_mutex_init(&ip->lock, NULL);
+    ip->m = res;
+    ip->groups = groups;
+    ip->maxdepth = maxdepth;
+    ip->flags = flags;
+    ip->scans = ip->scan.code != NULL;
+    res->interp = ip;
     res->groups = groups;
     res->flags = flags;
+    res->anchor = rejit_anchoring(instrs);
+    rejit_length_bounds(instrs, &res->minlen, &res->maxlen);
+    return res;
+
+fail:
+    free(ip->func.code);
+    free(ip->scan.code);
+    free(ip);
+    free(res);
+    return NULL;
+}
+
+// Compile a matcher to code that counts how its branches go, which is compiled
+// again once it has run for a while. Returns NULL if it couldn't be.
+static rejit_matcher profiled(rejit_compiler* c, rejit_instruction* instrs,
+                              int groups, int maxdepth, rejit_flags flags) {
+    rejit_matcher res = NULL;
+    interp* ip = malloc(sizeof(interp));
+    if (!ip) return NULL;
+    memset(ip, 0, sizeof(interp));
+    // The copy is compiled, so the counters line up with its instructions.
+    if ((ip->instrs = copy_instrs(instrs)) == NULL ||
+        start_profile(&ip->prof, ip->instrs) == -1 ||
+        (res = compile_jit(c, ip->instrs, groups, maxdepth, flags,
+                           &ip->prof)) == NULL) {
+        free(ip->instrs);
+        free(ip->prof.slot);
+        free(ip->prof.counts);
+        free(ip);
+        return NULL;
+    }
+    pthread_mutex_init(&ip->lock, NULL);
+    ip->m = res;
+    ip->groups = groups;
+    ip->maxdepth = maxdepth;
+    ip->flags = flags;
+    ip->state = COLD;
+    ip->scans = res->scan != res->func;
+    res->interp = ip;
     return res;
 }
 
+int rejit_reoptimize(rejit_matcher m) {
+    interp* ip = m->interp;
+    int done;
+    if (ip == NULL || !(ip->flags & RJ_FPROFILE)) return -1;
+    pthread_mutex_lock(&ip->lock);
+    if (ip->state != COLD) {
+        done = ip->state == DONE;
+        pthread_mutex_unlock(&ip->lock);
+        return done ? 0 : -1;
+    }
+    ip->state = COMPILING;
+    pthread_mutex_unlock(&ip->lock);
+    return recompile(ip, 1);
+}
+
+// Run the matcher's program, or the one that looks for where matches start if
+// scan is set, as machine code if it's been compiled and interpreted if not.
+static long run(rejit_matcher m, int scan, const char* str, void* groups) {
+    rejit_func f = __atomic_load_n(scan ? &m->scan : &m->func,
+                                   __ATOMIC_ACQUIRE);
+    interp* ip = m->interp;
+    unsigned long runs;
+    if (ip && __atomic_load_n(&ip->runs, __ATOMIC_RELAXED) <
+              (ip->flags & RJ_FPROFILE ? PROFILED : HOT) &&
+        ((runs = __atomic_add_fetch(&ip->runs, 1, __ATOMIC_RELAXED)) == HOT ||
+         runs == PROFILED))
+        heat(ip, runs);
+    if (f) return f(str, groups);
+    return interpret(scan && ip->scan.code ? &ip->scan : &ip->func, str,
+                     groups);
+}
+
+// Whether the matcher has a separate program to look for where matches start.
+static int has_scan(rejit_matcher m) {
+    return m->interp ? m->interp->scans : m->scan != m->func;
+}
+
 int rejit_match(rejit_matcher m, const char* str, rejit_group* groups) {
-    return m->func(str, groups);
+    if (m->word) return word_at(m, str) ? m->maxlen : -1;
+    return run(m, 0, str, groups);
+}
+
+int rejit_is_match(rejit_matcher m, const char* str) {
+    if (m->word) return word_at(m, str);
+    if (has_scan(m) || !m->groups) return run(m, 1, str, NULL) != -1;
+    // Backreferences need somewhere to put the groups.
+    rejit_group groups[m->groups];
+    return run(m, 0, str, groups) != -1;
+}
+
+int rejit_match_span32(rejit_matcher m, const char* str, rejit_span32* spans) {
+    if (m->word) return word_at(m, str) ? m->maxlen : -1;
+    return run(m, 0, str, spans);
+}
+
+// Clear groups to how they look if they didn't take part in the match.
+static void clear_groups(rejit_matcher m, void* groups) {
+    if (!m->groups) return;
+    if (m->flags & RJ_FSPAN32)
+        memset(groups, 0xff, sizeof(rejit_span32)*m->groups);
+    else memset(groups, 0, sizeof(rejit_group)*m->groups);
+}
+
+// Return where the match starts, trying only where one can.
+static const char* search(rejit_matcher m, const char* str, int* res,
+                          void* groups) {
+    const char* last = NULL;
+    size_t len;
+    *res = -1;
+    if (m->word) {
+        if ((last = find_word(m, str)) == NULL) return str;
+        *res = m->maxlen;
+        return last;
+    }
+    if (m->minlen > 0 || m->anchor & RJ_AEND) {
+        // Matches can't start closer to the end than the shortest one, and
+        // with a $ they can't start further from it than the longest one.
+        if ((len = strlen(str)) < (size_t)m->minlen) return str;
+        last = str+len-m->minlen;
+        if ((m->anchor & (RJ_ABEGIN|RJ_AEND)) == RJ_AEND && m->maxlen != -1 &&
+            len > (size_t)m->maxlen)
+            str += len-m->maxlen;
+    }
+    if (m->anchor & RJ_ABEGIN) last = str;
+    // Find where the match starts, then run the full program once there with
+    // clean groups. Unless the pattern has backreferences, this first pass
+    // writes no groups and skips the loops at the end.
+    for (; *str && (last == NULL || str <= last); ++str) {
+        if ((*res = run(m, 1, str, groups)) != -1) break;
+        if (m->anchor & RJ_ADOTSTAR) {
+            // That attempt already tried every start up to the next line.
+            if (m->flags & RJ_FDOTALL) break;
+            if ((str = strchr(str, '\n')) == NULL) break;
+        }
+    }
+    if (*res != -1 && (has_scan(m) || m->groups)) {
+        clear_groups(m, groups);
+        *res = run(m, 0, str, groups);
+    }
+    return str;
 }
 
 int rejit_search(rejit_matcher m, const char* str, const char** tgt,
                  rejit_group* groups) {
-    int res = -1;
-    for (;res == -1 && *str; ++str) {
-        if (m->groups) memset(groups, 0, sizeof(rejit_group)*m->groups);
-        res = rejit_match(m, str, groups);
-    }
-    if (tgt != NULL && res != -1) *tgt = str+1;
+    int res;
+    str = search(m, str, &res, groups);
+    if (tgt != NULL && res != -1) *tgt = str+2;
+    return res;
+}
+
+int rejit_search_span32(rejit_matcher m, const char* str, uint32_t* tgt,
+                        rejit_span32* spans) {
+    int res, i;
+    const char* at = search(m, str, &res, spans);
+    if (res == -1) return res;
+    // The program measured from where the match starts.
+    for (i=0; i<m->groups; ++i)
+        if (spans[i].begin != RJ_SPAN_NONE) {
+            spans[i].begin += at-str;
+            spans[i].end += at-str;
+        }
+    if (tgt != NULL) *tgt = at-str;
     return res;
 }
 
-void rejit_free_matcher(rejit_matcher m) { munmap(m->func, m->sz); free(m); }
+void rejit_free_matcher(rejit_matcher m) {
+    // It goes away with its image.
+    if (m->image) return;
+    if (m->interp) {
+        // If it's being compiled, whatever compiles it frees the rest.
+        pthread_mutex_lock(&m->interp->lock);
+        if (m->interp->state == COMPILING) {
+            m->interp->state = ORPHANED;
+            pthread_mutex_unlock(&m->interp->lock);
+        } else {
+            pthread_mutex_unlock(&m->interp->lock);
+            free_interp(m->interp);
+        }
+    }
+    if (!m->word && m->sz) free_code(m);
+    free(m);
+}
+
+// Patterns can also be written out as C, for rejit_static_matcher to run. The
+// C follows compile_one: labels are C labels, and threads resume at theirs
+// through a switch. Each program is written twice, the first time with no file
+// to find out which labels are used, since compilers warn about the rest.
+
+#define USED 1
+#define RESUMED 2
+
+typedef struct emitter_type {
+    FILE* f;
+    char* labels;
+    int nlabels, forks, saves, failed;
+} emitter;
+
+static void out(emitter* e, const char* fmt, ...) {
+    va_list args;
+    if (e->f == NULL) return;
+    va_start(args, fmt);
+    vfprintf(e->f, fmt, args);
+    va_end(args);
+}
+
+static void mark(emitter* e, int l, int how) {
+    char* labels;
+    int n;
+    if (l >= e->nlabels) {
+        for (n = e->nlabels ? e->nlabels : 64; n <= l; n *= 2);
+        if ((labels = rejit_alloc(NULL, n)) == NULL) {
+            e->failed = 1;
+            return;
+        }
+        memset(labels, 0, n);
+        if (e->labels) memcpy(labels, e->labels, e->nlabels);
+        rejit_free(NULL, e->labels);
+        e->labels = labels;
+        e->nlabels = n;
+    }
+    e->labels[l] |= how;
+}
+
+static void label(emitter* e, int l) {
+    if (l < e->nlabels && e->labels[l]) out(e, "L%d: ;\n", l);
+}
+
+static void jump(emitter* e, int l) {
+    mark(e, l, USED);
+    out(e, "goto L%d;\n", l);
+}
+
+// Push a thread resuming at l with the position, or with save slot slot's old
+// value if slot isn't -1.
+static void fork_at(emitter* e, int slot, int l) {
+    mark(e, l, RESUMED);
+    e->forks = 1;
+    if (slot == -1) out(e, "    RJ_FORK(str, %d);\n", l);
+    else out(e, "    RJ_FORK(slot[%d], %d);\n", slot, l);
+}
+
+static void emit_char(emitter* e, unsigned char c) {
+    if (c == '\'' || c == '\\') out(e, "'\\%c'", c);
+    else if (isprint(c)) out(e, "'%c'", c);
+    else out(e, "'\\%03o'", c);
+}
+
+static void emit_string(emitter* e, const char* s, size_t len) {
+    unsigned char c;
+    out(e, "\"");
+    for (; len--; ++s) {
+        c = *s;
+        if (c == '"' || c == '\\') out(e, "\\%c", c);
+        // Keep ? out, so nothing reads as a trigraph.
+        else if (isprint(c) && c != '?') out(e, "%c", c);
+        else out(e, "\\%03o", c);
+    }
+    out(e, "\"");
+}
+
+static void emit_bail(emitter* e, rejit_instruction* ia, int errpc, int saved) {
+    if (ia->kind < RJ_IGROUP || ia->kind > RJ_INLBEHIND) return;
+    if (saves(ia)) {
+        out(e, "    if (str == slot[%d]) ", saved);
+        jump(e, errpc);
+    } else if (fixed_len(ia) == 0) {
+        out(e, "    ");
+        jump(e, errpc);
+    }
+}
+
+static void emit_stop(emitter* e, rejit_instruction* ia, int l) {
+    if (ia->kind != RJ_INSET) return;
+    out(e, "    if (!*str) ");
+    jump(e, l);
+}
+
+static void emit_one(emitter* e, rejit_instruction* instr, int errpc, int* pcl,
+                     int saved, rejit_flags flags) {
+    rejit_instruction* ia, *ib, *ic;
+    alt_bytes* ab;
+    unsigned char set[32], c;
+    char* s, *p;
+    int bk, nx, i, j, rl, neg;
+    long len;
+    Rune r;
+    if (instr->kind > RJ_ISKIP) return;
+    switch (instr->kind) {
+    case RJ_ISKIP: printf("RJ_ISKIP was added to RJ_INULL\n"); abort();
+    case RJ_IWORD:
+        s = (char*)instr->value;
+        if ((len = strlen(s)) == 0) break;
+        if (len > 16 && !(flags & RJ_FICASE)) {
+            out(e, "    if (strncmp(str, ");
+            emit_string(e, s, len);
+            out(e, ", %ld)) ", len);
+        } else {
+            // A mismatch on the terminating NUL stops it reading further.
+            out(e, "    if (");
+            for (i=0; i<len; ++i) {
+                c = s[i];
+                if (i) out(e, " ||\n        ");
+                if (flags & RJ_FICASE && isalpha(c)) {
+                    out(e, "(str[%d] != ", i);
+                    emit_char(e, toupper(c));
+                    out(e, " && str[%d] != ", i);
+                    emit_char(e, tolower(c));
+                    out(e, ")");
+                } else {
+                    out(e, "str[%d] != ", i);
+                    emit_char(e, c);
+                }
+            }
+            out(e, ") ");
+        }
+        jump(e, errpc);
+        out(e, "    str += %ld;\n", len);
+        break;
+    case RJ_ISTAR:
+    case RJ_IPLUS:
+    case RJ_IOPT:
+        ia = instr+1;
+        bk = *pcl;
+        *pcl += 2;
+        label(e, bk);
+        if (instr->kind == RJ_ISTAR) emit_stop(e, ia, bk+1);
+        if (instr->kind != RJ_IPLUS) fork_at(e, -1, bk+1);
+        emit_one(e, ia, errpc, pcl, saved, flags);
+        emit_bail(e, ia, errpc, saved);
+        if (instr->kind == RJ_IPLUS) {
+            emit_stop(e, ia, bk+1);
+            fork_at(e, -1, bk+1);
+        }
+        if (instr->kind != RJ_IOPT) {
+            out(e, "    ");
+            jump(e, bk);
+        }
+        label(e, bk+1);
+        skip(ia);
+        break;
+    case RJ_IREP:
+        ia = instr+1;
+        for (i=0; i<instr->value; ++i) {
+            emit_one(e, ia, errpc, pcl, saved, flags);
+            unskip(ia);
+        }
+        bk = (*pcl)++;
+        for (i=instr->value; i<instr->value2; ++i) {
+            fork_at(e, -1, bk);
+            emit_one(e, ia, errpc, pcl, saved, flags);
+            unskip(ia);
+        }
+        label(e, bk);
+        skip(ia);
+        break;
+    case RJ_IMSTAR:
+    case RJ_IMPLUS:
+        ia = instr+1;
+        bk = *pcl;
+        *pcl += 3;
+        if (instr->kind == RJ_IMSTAR) {
+            out(e, "    ");
+            jump(e, bk+1);
+        }
+        label(e, bk);
+        emit_one(e, ia, errpc, pcl, saved, flags);
+        emit_bail(e, ia, errpc, saved);
+        label(e, bk+1);
+        emit_stop(e, ia, bk+2);
+        skip(ia);
+        fork_at(e, -1, bk);
+        label(e, bk+2);
+        break;
+    case RJ_IDOT:
+        if (flags & RJ_FDOTALL) out(e, "    if (!*str) ");
+        else out(e, "    if (!*str || *str == '\\n') ");
+        jump(e, errpc);
+        out(e, "    ++str;\n");
+        break;
+    case RJ_IBEGIN:
+        out(e, "    if (str != sav) ");
+        jump(e, errpc);
+        break;
+    case RJ_IEND:
+        out(e, "    if (*str) ");
+        jump(e, errpc);
+        break;
+    case RJ_IBACK:
+        // An empty or unset group never matches, as in compile_one.
+        out(e, "    {\n");
+        if (flags & RJ_FSPAN32) {
+            out(e, "        rejit_span32* span = (rejit_span32*)groups+%ld;\n"
+                   "        const char* from = sav+span->begin;\n"
+                   "        size_t n = (uint32_t)(span->end-span->begin);\n",
+                (long)instr->value);
+        } else {
+            out(e, "        const char* from = groups[%ld].begin;\n"
+                   "        size_t n = groups[%ld].end-from;\n",
+                (long)instr->value, (long)instr->value);
+        }
+        out(e, "        if (!n || strncmp(str, from, n)) ");
+        jump(e, errpc);
+        out(e, "        str += n;\n    }\n");
+        break;
+    case RJ_ISET:
+    case RJ_INSET:
+        // The same set as genmagic builds: single bytes, in either case with
+        // RJ_FICASE, are looked up in a table, and multibyte characters are
+        // compared whole beforehand.
+        s = (char*)instr->value;
+        neg = instr->kind == RJ_INSET;
+        bk = (*pcl)++;
+        memset(set, 0, sizeof(set));
+        for (p = s; *p; p += rl) {
+            if ((rl = chartorune(&r, p)) > 1) continue;
+            for (j=0; j<(flags & RJ_FICASE ? 2 : 1); ++j) {
+                c = *p;
+                if (flags & RJ_FICASE) c = j ? toupper(c) : tolower(c);
+                set[c>>3] |= 1<<(c&7);
+            }
+        }
+        out(e, "    {\n        static const unsigned char set[32] = {");
+        for (i=0; i<32; ++i)
+            out(e, "%s0x%02x", i%8 ? ", " : i ? ",\n            " :
+                                              "\n            ", set[i]);
+        out(e, "\n        };\n        unsigned char c = *str;\n");
+        if (neg) {
+            out(e, "        if (!c) ");
+            jump(e, bk);
+        }
+        for (p = s; *p; p += rl) {
+            if ((rl = chartorune(&r, p)) == 1) continue;
+            out(e, "        if (c == 0x%02x", (unsigned char)*p);
+            for (i=1; i<rl; ++i) {
+                out(e, " && str[%d] == ", i);
+                emit_char(e, p[i]);
+            }
+            if (neg) {
+                out(e, ") ");
+                jump(e, errpc);
+            } else {
+                out(e, ") {\n            str += %d;\n            ", rl);
+                jump(e, bk);
+                out(e, "        }\n");
+            }
+        }
+        if (neg) out(e, "        if (set[c>>3] & 1<<(c&7)) ");
+        else out(e, "        if (!(set[c>>3] & 1<<(c&7))) ");
+        jump(e, errpc);
+        out(e, "        ++str;\n    }\n");
+        label(e, bk);
+        break;
+    case RJ_IUSET:
+        out(e, "    {\n        Rune r;\n        int n;\n        if (!*str) ");
+        jump(e, errpc);
+        out(e, "        n = chartorune(&r, (char*)str);\n        str += n;\n"
+               "        if (");
+        switch (instr->value) {
+        case 's': out(e, "%sisspacerune(r)", instr->value2 ? "" : "!"); break;
+        case 'd': out(e, "%sisdigitrune(r)", instr->value2 ? "" : "!"); break;
+        case 'w':
+            if (instr->value2) out(e, "isalnumrune(r) || r == '_'");
+            else out(e, "!isalnumrune(r) && r != '_'");
+            break;
+        }
+        out(e, ") ");
+        jump(e, errpc);
+        out(e, "    }\n");
+        break;
+    case RJ_IOR:
+        ic = (rejit_instruction*)instr->value2;
+        ab = count_alts(instr, flags);
+        bk = (*pcl)++;
+        for (;;) {
+            ia = instr+1;
+            ib = (rejit_instruction*)instr->value;
+            nx = (*pcl)++;
+            i = alt_first(ia, ib, flags);
+            if (ab) count_alt(ab, i, -1);
+            if (i != -1) {
+                out(e, "    if (*str != ");
+                emit_char(e, i);
+                out(e, ") ");
+                jump(e, nx);
+            }
+            if (i == -1 || !ab || ab->unknown || ab->n[i]) fork_at(e, -1, nx);
+            for (; ia != ib; ia = expr_end(ia)) {
+                emit_one(e, ia, errpc, pcl, saved, flags);
+                skip(ia);
+            }
+            out(e, "    ");
+            jump(e, bk);
+            label(e, nx);
+            if (!CHAINED(ib, ic)) break;
+            instr = ib;
+            skip(instr);
+        }
+        rejit_free(NULL, ab);
+        for (ia = ib; ia != ic; ia = expr_end(ia)) {
+            emit_one(e, ia, errpc, pcl, saved, flags);
+            skip(ia);
+        }
+        label(e, bk);
+        break;
+    case RJ_ICGROUP:
+    case RJ_IGROUP:
+    case RJ_ILAHEAD:
+    case RJ_INLAHEAD:
+    case RJ_ILBEHIND:
+    case RJ_INLBEHIND:
+        neg = instr->kind == RJ_INLAHEAD || instr->kind == RJ_INLBEHIND;
+        bk = *pcl;
+        *pcl += 2;
+        ia = instr+1;
+        ib = (rejit_instruction*)instr->value;
+        len = 0;
+        if (instr->kind == RJ_ILAHEAD) len = fixed_range_len(ia, ib);
+        else if (instr->kind == RJ_ILBEHIND || instr->kind == RJ_INLBEHIND)
+            len = lookbehind_len(instr);
+        i = saves(instr);
+        if (i) {
+            e->saves = 1;
+            fork_at(e, saved, 1+saved);
+            out(e, "    slot[%d] = str;\n", saved);
+        }
+        if ((instr->kind == RJ_ILBEHIND || instr->kind == RJ_INLBEHIND) &&
+            len > 0) {
+            out(e, "    if (str-sav < %ld) ", len);
+            jump(e, bk);
+            out(e, "    str -= %ld;\n", len);
+        }
+        for (; ia != ib; ia = expr_end(ia)) {
+            emit_one(e, ia, bk, pcl, saved+i, flags);
+            skip(ia);
+        }
+        if (neg) {
+            out(e, "    str = slot[%d];\n    ", saved);
+            jump(e, errpc);
+        } else {
+            out(e, "    ");
+            jump(e, bk+1);
+        }
+        label(e, bk);
+        if (i) out(e, "    str = slot[%d];\n", saved);
+        if (!neg) {
+            out(e, "    ");
+            jump(e, errpc);
+            label(e, bk+1);
+        }
+
+        if (instr->kind == RJ_ILAHEAD || instr->kind == RJ_ILBEHIND) {
+            if (i) out(e, "    str = slot[%d];\n", saved);
+            else if (instr->kind == RJ_ILAHEAD && len)
+                out(e, "    str -= %ld;\n", len);
+        }
+
+        if (instr->kind == RJ_ICGROUP && !(flags & RJ_FNOCAPTURE)) {
+            if (flags & RJ_FSPAN32)
+                out(e, "    ((rejit_span32*)groups)[%ld].begin = ",
+                    (long)instr->value2);
+            else out(e, "    groups[%ld].begin = ", (long)instr->value2);
+            if (i) out(e, "slot[%d]", saved);
+            else out(e, "str-%ld", (long)instr->len);
+            if (flags & RJ_FSPAN32)
+                out(e, "-sav;\n    ((rejit_span32*)groups)[%ld].end = str-sav;\n",
+                    (long)instr->value2);
+            else out(e, ";\n    groups[%ld].end = str;\n", (long)instr->value2);
+        }
+        break;
+    default: printf("unrecognized opcode: %d\n", instr->kind); abort();
+    }
+}
+
+static void emit_clear(emitter* e, rejit_instruction* instrs, int groups,
+                       rejit_flags flags) {
+    rejit_instruction* ia, *ib;
+    for (ia = instrs; ia->kind; ++ia) {
+        if (ia->kind != RJ_IBACK || ia->value < 0 || ia->value >= groups)
+            continue;
+        for (ib = instrs; ib != ia; ++ib)
+            if (ib->kind == RJ_IBACK && ib->value == ia->value) break;
+        if (ib != ia) continue;
+        if (flags & RJ_FSPAN32)
+            out(e, "    ((rejit_span32*)groups)[%ld].begin = "
+                   "((rejit_span32*)groups)[%ld].end = RJ_SPAN_NONE;\n",
+                (long)ia->value, (long)ia->value);
+        else out(e, "    groups[%ld].begin = groups[%ld].end = NULL;\n",
+                 (long)ia->value, (long)ia->value);
+    }
+}
+
+static void emit_program(emitter* e, const char* name, const char* suffix,
+                         rejit_instruction* instrs, int groups, int maxdepth,
+                         rejit_flags flags) {
+    rejit_instruction* ia, *ib;
+    int i, pcl, saved;
+    const char* ret = e->forks ? "RJ_RETURN(str-sav)" : "return str-sav";
+    for (i=0; instrs[i].kind; ++i);
+    if ((i = measure(instrs, &instrs[i], 0)) < maxdepth) maxdepth = i;
+    if (flags & SHORTEST) {
+        for (i=0; instrs[i].kind; ++i);
+        while ((ia = tail_loop(instrs, &instrs[i])))
+            for (ib = expr_end(ia); ia != ib; ++ia) skip(ia);
+    }
+    // Label 0 backtracks, and 1+i puts back save slot i.
+    pcl = 1+maxdepth;
+
+    out(e, "static long %s_%s(const char* str, rejit_group* groups) {\n"
+           "    const char* const sav = str;\n", name, suffix);
+    // The groups that save may all have been skipped by SHORTEST.
+    if (!e->saves) maxdepth = 0;
+    if (maxdepth) out(e, "    const char* slot[%d] = {0};\n", maxdepth);
+    if (e->forks)
+        out(e, "    rejit_static_thread stk0[RJ_STACK], *stk = stk0, *tp = stk0,"
+               " *end = stk0+RJ_STACK;\n");
+    emit_clear(e, instrs, groups, flags);
+    for (i=0; instrs[i].kind; ++i) emit_one(e, &instrs[i], 0, &pcl, 0, flags);
+    out(e, "    %s;\n", ret);
+    if (e->forks) mark(e, 0, USED);
+    label(e, 0);
+    if (e->forks) {
+        out(e, "    if (tp == stk) RJ_RETURN(-1);\n    str = (--tp)->str;\n"
+               "    switch (tp->jmp) {\n");
+        // The last case is the default, so the compiler sees every path
+        // return.
+        for (i = e->nlabels-1; i > 0 && !(e->labels[i] & RESUMED); --i);
+        for (saved=0; saved<i; ++saved)
+            if (e->labels[saved] & RESUMED)
+                out(e, "    case %d: goto L%d;\n", saved, saved);
+        out(e, "    default: goto L%d;\n    }\n", i);
+        // Undo a save: the old value was just loaded into str.
+        for (saved=0; saved<maxdepth; ++saved) {
+            label(e, 1+saved);
+            out(e, "    slot[%d] = str;\n    ", saved);
+            jump(e, 0);
+        }
+    } else out(e, "    return -1;\n");
+    out(e, "}\n\n");
+    for (i=0; instrs[i].kind; ++i)
+        if (instrs[i].kind > RJ_ISKIP) instrs[i].kind -= RJ_ISKIP;
+}
+
+// Write a program twice: first to find the labels, then for real.
+static void emit_twice(emitter* e, const char* name, const char* suffix,
+                       rejit_instruction* instrs, int groups, int maxdepth,
+                       rejit_flags flags) {
+    FILE* f = e->f;
+    if (e->labels) memset(e->labels, 0, e->nlabels);
+    e->forks = e->saves = 0;
+    e->f = NULL;
+    emit_program(e, name, suffix, instrs, groups, maxdepth, flags);
+    e->f = f;
+    emit_program(e, name, suffix, instrs, groups, maxdepth, flags);
+}
+
+// Everything the programs share. It's guarded, so the output for several
+// patterns can go into one file.
+static const char prelude[] =
+    "#ifndef REJIT_STATIC_PRELUDE\n"
+    "#define REJIT_STATIC_PRELUDE\n"
+    "#include <stdlib.h>\n"
+    "#include \"rejit.h\"\n\n"
+    "#define RJ_STACK 64\n\n"
+    "typedef struct {\n"
+    "    const char* str;\n"
+    "    int jmp;\n"
+    "} rejit_static_thread;\n\n"
+    "// Move the threads to the heap, or to a bigger block of it.\n"
+    "static inline int rejit_static_grow(rejit_static_thread** stk,\n"
+    "                                    rejit_static_thread** tp,\n"
+    "                                    rejit_static_thread** end,\n"
+    "                                    rejit_static_thread* stk0) {\n"
+    "    size_t n = *end-*stk, used = *tp-*stk;\n"
+    "    rejit_static_thread* p = malloc(2*n*sizeof(rejit_static_thread));\n"
+    "    if (p == NULL) return 0;\n"
+    "    memcpy(p, *stk, used*sizeof(rejit_static_thread));\n"
+    "    if (*stk != stk0) free(*stk);\n"
+    "    *stk = p;\n"
+    "    *tp = p+used;\n"
+    "    *end = p+2*n;\n"
+    "    return 1;\n"
+    "}\n\n"
+    "#define RJ_RETURN(r) do {\\\n"
+    "    if (stk != stk0) free(stk);\\\n"
+    "    return (r);\\\n"
+    "} while (0)\n"
+    "#define RJ_FORK(s, l) do {\\\n"
+    "    if (tp == end && !rejit_static_grow(&stk, &tp, &end, stk0))\\\n"
+    "        RJ_RETURN(-1);\\\n"
+    "    tp->str = (s);\\\n"
+    "    tp->jmp = (l);\\\n"
+    "    ++tp;\\\n"
+    "} while (0)\n"
+    "#endif\n\n";
+
+int rejit_emit_c_instrs(FILE* f, const char* name, rejit_instruction* instrs,
+                        int groups, int maxdepth, rejit_flags flags) {
+    emitter e;
+    rejit_anchor anchor;
+    long minlen, maxlen;
+    int back = reads_groups(instrs), scan = 0, n;
+    e.f = f;
+    e.labels = NULL;
+    e.nlabels = e.forks = e.saves = e.failed = 0;
+    out(&e, "%s", prelude);
+    if (instrs[0].kind == RJ_IWORD && instrs[1].kind == RJ_INULL &&
+        *(char*)instrs[0].value) {
+        n = strlen((char*)instrs[0].value);
+        out(&e, "const rejit_static %s = {NULL, NULL, 0, (rejit_flags)%d, "
+                "RJ_ANONE, %d, %d,\n    ", name, flags, n, n);
+        emit_string(&e, (char*)instrs[0].value, n);
+        out(&e, "};\n\n");
+        return ferror(f) ? -1 : 0;
+    }
+    for (n=0; instrs[n].kind; ++n);
+    if (back) flags &= ~RJ_FNOCAPTURE;
+    else if (flags & RJ_FNOCAPTURE) groups = 0;
+    if (calls_helpers(instrs)) out(&e, "#include \"utf.h\"\n\n");
+    emit_twice(&e, name, "func", instrs, groups, maxdepth, flags);
+    if (!back && (groups || tail_loop(instrs, &instrs[n]))) {
+        scan = 1;
+        emit_twice(&e, name, "scan", instrs, groups, maxdepth,
+                   flags | RJ_FNOCAPTURE | SHORTEST);
+    }
+    anchor = rejit_anchoring(instrs);
+    rejit_length_bounds(instrs, &minlen, &maxlen);
+    out(&e, "const rejit_static %s = {%s_func, %s_%s, %d, (rejit_flags)%d,\n"
+            "    (rejit_anchor)%d, %ld, %ld, NULL};\n\n", name, name, name,
+        scan ? "scan" : "func", groups, flags, anchor, minlen, maxlen);
+    rejit_free(NULL, e.labels);
+    return e.failed || ferror(f) ? -1 : 0;
+}
@@ -4,17 +4,88 @@
 
 #include "rejit.h"
 
+#include <stdlib.h>
+
 rejit_matcher rejit_compile(rejit_parse_result res, rejit_flags flags) {
     return rejit_compile_instrs(res.instrs, res.groups, res.maxdepth,
                                 res.flags | flags);
 }
 
+rejit_matcher rejit_compiler_compile(rejit_compiler* c, rejit_parse_result res,
+                                     rejit_flags flags) {
+    return rejit_compiler_compile_instrs(c, res.instrs, res.groups,
+                                         res.maxdepth, res.flags | flags);
+}
+
+int rejit_emit_c(FILE* f, const char* name, rejit_parse_result res,
+                 rejit_flags flags) {
+    return rejit_emit_c_instrs(f, name, res.instrs, res.groups, res.maxdepth,
+                               res.flags | flags);
+}
+
+rejit_matcher rejit_compile_groups(rejit_parse_result res, rejit_flags flags,
+                                   const uint64_t* mask) {
+    rejit_instruction* old, *ia;
+    rejit_matcher m;
+    int* map, i, n = 0;
+    size_t len;
+    for (len=0; res.instrs[len].kind; ++len);
+    old = rejit_alloc(NULL, len*sizeof(rejit_instruction));
+    map = rejit_alloc(NULL, (res.groups+1)*sizeof(int));
+    if (!old || !map) {
+        rejit_free(NULL, old);
+        rejit_free(NULL, map);
+        return NULL;
+    }
+
+    for (i=0; i<res.groups; ++i) map[i] = mask[i/64] >> i%64 & 1 ? n++ : -1;
+    // Groups that backreferences read are needed too, and go after the ones
+    // that were asked for.
+    for (ia = res.instrs; ia->kind; ++ia)
+        if (ia->kind == RJ_IBACK && ia->value < res.groups &&
+            map[ia->value] == -1)
+            map[ia->value] = n++;
+
+    memcpy(old, res.instrs, len*sizeof(rejit_instruction));
+    for (ia = res.instrs; ia->kind; ++ia)
+        if (ia->kind == RJ_ICGROUP) {
+            if (map[ia->value2] == -1) ia->kind = RJ_IGROUP;
+            else ia->value2 = map[ia->value2];
+        } else if (ia->kind == RJ_IBACK && ia->value < res.groups)
+            ia->value = map[ia->value];
+    m = rejit_compile_instrs(res.instrs, n, res.maxdepth, res.flags | flags);
+    memcpy(res.instrs, old, len*sizeof(rejit_instruction));
+
+    rejit_free(NULL, old);
+    rejit_free(NULL, map);
+    return m;
+}
+
 rejit_matcher rejit_parse_compile(const char* str, rejit_parse_error* err,
                                   rejit_flags flags) {
     rejit_matcher m;
     rejit_parse_result p = rejit_parse(str, err, flags);
-    if (err->kind != RJ_PE_NONE) return (rejit_matcher)NULL;
+    if (err->kind != RJ_PE_NONE) {
+        rejit_free_parse_result(p);
+        return (rejit_matcher)NULL;
+    }
+    rejit_optimize(&p, RJ_OALL);
     m = rejit_compile(p, flags);
     rejit_free_parse_result(p);
     return m;
 }
+
+rejit_matcher rejit_compiler_parse_compile(rejit_compiler* c, const char* str,
+                                           rejit_parse_error* err,
+                                           rejit_flags flags) {
+    rejit_matcher m;
+    rejit_parse_result p = rejit_parse(str, err, flags);
+    if (err->kind != RJ_PE_NONE) {
+        rejit_free_parse_result(p);
+        return (rejit_matcher)NULL;
+    }
+    rejit_optimize(&p, RJ_OALL);
+    m = rejit_compiler_compile(c, p, flags);
+    rejit_free_parse_result(p);
+    return m;
+}
@@ -0,0 +1,327 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+   License, v. 2.0. If a copy of the MPL was not distributed with this
+   file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "rejit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The instructions are lifted into a tree, every sequence in it is rewritten
+// by the enabled passes from the innermost outwards, and the tree is lowered
+// back over the original array. No pass adds instructions, so the array never
+// has to grow.
+
+typedef struct node_type {
+    rejit_instruction instr;
+    // Groups hold their contents and prefix operators their operand. An RJ_IOR
+    // holds every alternative of its a|b|c chain as an RJ_INULL node whose body
+    // is the alternative.
+    struct node_type* body, *next;
+} node;
+
+typedef struct opt_ctx_type {
+    rejit_parse_result* res;
+    rejit_opt_passes passes;
+    node* nodes;
+    size_t nnodes, len;
+    int depth;
+} opt_ctx;
+
+#define PREFIX(n) ((n)->instr.kind > RJ_IARG && (n)->instr.kind < RJ_IVARG)
+#define CHAINED(ia,e) ((ia) != (e) && (ia)->kind == RJ_IOR &&\
+                       (rejit_instruction*)(ia)->value2 == (e))
+
+static node* lift(opt_ctx* c, rejit_instruction* b, rejit_instruction* e);
+
+static rejit_instruction* lift_one(opt_ctx* c, node* n, rejit_instruction* ip) {
+    rejit_instruction* mid, *end;
+    node** tail = &n->body;
+    n->instr = *ip;
+    if (ip->kind == RJ_IOR) {
+        end = (rejit_instruction*)ip->value2;
+        for (;;) {
+            mid = (rejit_instruction*)ip->value;
+            *tail = &c->nodes[c->nnodes++];
+            (*tail)->body = lift(c, ip+1, mid);
+            tail = &(*tail)->next;
+            if (!CHAINED(mid, end)) break;
+            ip = mid;
+        }
+        *tail = &c->nodes[c->nnodes++];
+        (*tail)->body = lift(c, mid, end);
+        return end;
+    } else if (ip->kind > RJ_IVARG) {
+        n->body = lift(c, ip+1, (rejit_instruction*)ip->value);
+        return (rejit_instruction*)ip->value;
+    } else if (ip->kind > RJ_IARG) {
+        n->body = &c->nodes[c->nnodes++];
+        return lift_one(c, n->body, ip+1);
+    } else return ip+1;
+}
+
+static node* lift(opt_ctx* c, rejit_instruction* b, rejit_instruction* e) {
+    node* head = NULL, **tail = &head;
+    while (b != e) {
+        *tail = &c->nodes[c->nnodes++];
+        b = lift_one(c, *tail, b);
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+static void lower(opt_ctx* c, node* n, int depth, int lb);
+
+static void lower_one(opt_ctx* c, node* n, int depth) {
+    rejit_instruction* out = c->res->instrs;
+    size_t at = c->len++;
+    node* alt;
+    out[at] = n->instr;
+    out[at].len_from = NULL;
+    if (n->instr.kind == RJ_IOR) {
+        // Every alternative but the last gets its own RJ_IOR, and they all end
+        // in the same place.
+        for (alt = n->body;; alt = alt->next) {
+            alt->instr.value = at;
+            lower(c, alt->body, depth, 0);
+            out[at].value = (intptr_t)&out[c->len];
+            if (alt->next->next == NULL) break;
+            at = c->len++;
+            out[at] = n->instr;
+            out[at].len_from = NULL;
+        }
+        lower(c, alt->next->body, depth, 0);
+        for (alt = n->body; alt->next; alt = alt->next)
+            out[alt->instr.value].value2 = (intptr_t)&out[c->len];
+    } else if (n->instr.kind > RJ_IVARG) {
+        if (depth >= c->depth) c->depth = depth+1;
+        lower(c, n->body, depth+1, n->instr.kind == RJ_ILBEHIND ||
+                                   n->instr.kind == RJ_INLBEHIND);
+        out[at].value = (intptr_t)&out[c->len];
+    } else if (PREFIX(n)) lower_one(c, n->body, depth);
+}
+
+static void lower(opt_ctx* c, node* n, int depth, int lb) {
+    rejit_instruction* ia;
+    for (; n; n = n->next) {
+        ia = &c->res->instrs[c->len];
+        lower_one(c, n, depth);
+        // Lookbehinds sum the lengths of their direct children.
+        if (lb) ia->len = rejit_match_len(ia);
+    }
+}
+
+// Whether n always matches nothing and has no other effect.
+static int is_empty(node* n) {
+    if (PREFIX(n)) return is_empty(n->body);
+    if (n->instr.kind == RJ_IWORD) return !*(char*)n->instr.value;
+    return n->body == NULL && (n->instr.kind == RJ_IGROUP ||
+                               n->instr.kind == RJ_ILAHEAD ||
+                               n->instr.kind == RJ_ILBEHIND);
+}
+
+static node* drop_empty(opt_ctx* c, node* list, int arg) {
+    node** p = &list;
+    if (arg) return list;
+    while (*p)
+        if (is_empty(*p)) *p = (*p)->next;
+        else p = &(*p)->next;
+    return list;
+}
+
+static node* set_to_word(opt_ctx* c, node* list, int arg) {
+    node* n;
+    char* s;
+    for (n = list; n; n = n->next) {
+        if (n->instr.kind != RJ_ISET) continue;
+        s = (char*)n->instr.value;
+        // A set starts with its NUL-terminated members, so a set of one
+        // character already reads as a word.
+        if (s[0] && !s[1] && (unsigned char)s[0] < 0x80) {
+            n->instr.kind = RJ_IWORD;
+            n->instr.len = 1;
+        }
+    }
+    return list;
+}
+
+static node* rep_to_word(opt_ctx* c, node* list, int arg) {
+    node* n;
+    char* s, *w;
+    size_t len;
+    intptr_t i;
+    for (n = list; n; n = n->next) {
+        if (n->instr.kind != RJ_IREP || n->body->instr.kind != RJ_IWORD ||
+            n->instr.value != n->instr.value2 || n->instr.value <= 0)
+            continue;
+        w = (char*)n->body->instr.value;
+        len = strlen(w);
+        if (!len || (size_t)n->instr.value > ((size_t)-1)/2/len) continue;
+        if ((s = rejit_arena_alloc(&c->res->arena, len*n->instr.value+1)) == NULL)
+            continue;
+        for (i=0; i<n->instr.value; ++i) memcpy(s+i*len, w, len);
+        n->instr.kind = RJ_IWORD;
+        n->instr.len = len*n->instr.value;
+        n->instr.value = (intptr_t)s;
+        n->instr.value2 = 0;
+        n->body = NULL;
+    }
+    return list;
+}
+
+// The characters matched by an alternative of one ASCII character or set of
+// them, or NULL if it is anything else.
+static const char* one_char(node* n) {
+    const char* s, *p;
+    if (n == NULL || n->next != NULL) return NULL;
+    if (n->instr.kind != RJ_IWORD && n->instr.kind != RJ_ISET) return NULL;
+    s = (const char*)n->instr.value;
+    if (n->instr.kind == RJ_IWORD && (!s[0] || s[1])) return NULL;
+    for (p = s; *p; ++p) if ((unsigned char)*p >= 0x80) return NULL;
+    return s;
+}
+
+static node* alts_to_set(opt_ctx* c, node* list, int arg) {
+    node** p, *n, *alt, *e;
+    char seen[128], *s, *q;
+    const char* m;
+    size_t len, i;
+    for (p = &list; (n = *p); p = &(*p)->next) {
+        if (n->instr.kind != RJ_IOR) continue;
+        for (alt = n->body; alt; alt = alt->next) {
+            // Only neighbours are joined, so the order alternatives are tried
+            // in doesn't change.
+            len = 0;
+            for (e = alt; e && (m = one_char(e->body)); e = e->next)
+                len += strlen(m);
+            if (e == alt || e == alt->next) continue;
+            if ((s = rejit_arena_alloc(&c->res->arena, len*2+2)) == NULL)
+                continue;
+            memset(seen, 0, sizeof(seen));
+            for (q = s, e = alt; e && (m = one_char(e->body)); e = e->next)
+                for (; *m; ++m)
+                    if (!seen[(unsigned char)*m]) {
+                        seen[(unsigned char)*m] = 1;
+                        *q++ = *m;
+                    }
+            len = q-s;
+            *q++ = 0;
+            for (i=0; i<len; ++i) *q++ = ' ';
+            alt->body->instr.kind = RJ_ISET;
+            alt->body->instr.value = (intptr_t)s;
+            alt->body->instr.len = 1;
+            alt->next = e;
+        }
+        if (n->body->next == NULL) {
+            // Everything became one set.
+            n->body->body->next = n->next;
+            *p = n->body->body;
+        }
+    }
+    return list;
+}
+
+// Whether n always consumes a fixed, non-empty piece of the input, so it needs
+// no group around it to be quantified.
+static int is_atom(node* n) {
+    switch (n->instr.kind) {
+    case RJ_IWORD: case RJ_ISET: case RJ_IUSET: case RJ_IDOT: return 1;
+    default: return 0;
+    }
+}
+
+static node* concat(opt_ctx* c, node* list, int arg) {
+    node** p, *n, *e;
+    char* s, *q;
+    size_t len;
+
+    if (arg) {
+        // Suffixes apply to whole words, so (?:ab)* is ab*.
+        if (list->instr.kind == RJ_IGROUP && list->body &&
+            list->body->next == NULL && is_atom(list->body)) {
+            list->body->next = list->next;
+            return list->body;
+        }
+        return list;
+    }
+
+    // Splice non-capturing groups into the surrounding sequence. Their insides
+    // were already flattened.
+    for (p = &list; (n = *p);) {
+        if (n->instr.kind != RJ_IGROUP) {
+            p = &n->next;
+            continue;
+        }
+        *p = n->body;
+        while (*p) p = &(*p)->next;
+        *p = n->next;
+    }
+
+    // Join runs of neighbouring words.
+    for (n = list; n; n = n->next) {
+        if (n->instr.kind != RJ_IWORD || !n->next ||
+            n->next->instr.kind != RJ_IWORD)
+            continue;
+        len = 0;
+        for (e = n; e && e->instr.kind == RJ_IWORD; e = e->next)
+            len += strlen((char*)e->instr.value);
+        if ((s = rejit_arena_alloc(&c->res->arena, len+1)) == NULL) continue;
+        for (q = s, e = n; e && e->instr.kind == RJ_IWORD; e = e->next) {
+            size_t l = strlen((char*)e->instr.value);
+            memcpy(q, (char*)e->instr.value, l);
+            q += l;
+        }
+        n->instr.value = (intptr_t)s;
+        n->instr.len = len;
+        n->next = e;
+    }
+
+    return list;
+}
+
+static const struct {
+    rejit_opt_passes pass;
+    node* (*run)(opt_ctx*, node*, int);
+} passes[] = {
+    {RJ_OEMPTY, drop_empty},
+    {RJ_OSETWORD, set_to_word},
+    {RJ_OREPWORD, rep_to_word},
+    {RJ_OALTSET, alts_to_set},
+    {RJ_OCONCAT, concat},
+};
+
+// arg is set when list is the operand of a prefix operator, which has to stay
+// a single expression.
+static node* simplify(opt_ctx* c, node* list, int arg) {
+    node* n;
+    size_t i;
+    for (n = list; n; n = n->next)
+        if (n->body) n->body = simplify(c, n->body, PREFIX(n));
+    for (i=0; i<sizeof(passes)/sizeof(passes[0]); ++i)
+        if (c->passes & passes[i].pass) list = passes[i].run(c, list, arg);
+    return list;
+}
+
+void rejit_optimize(rejit_parse_result* res, rejit_opt_passes passes) {
+    opt_ctx c;
+    node* tree;
+    size_t n;
+
+    if (passes == RJ_ONONE) return;
+    for (n=0; res->instrs[n].kind != RJ_INULL; ++n);
+
+    c.res = res;
+    c.passes = passes;
+    c.nnodes = c.len = 0;
+    c.depth = 0;
+    // One node per instruction and at most one more per alternative.
+    if ((c.nodes = rejit_alloc(NULL, (n*2+1)*sizeof(node))) == NULL) return;
+    memset(c.nodes, 0, (n*2+1)*sizeof(node));
+
+    tree = simplify(&c, lift(&c, res->instrs, res->instrs+n), 0);
+    lower(&c, tree, 0, 0);
+    memset(&res->instrs[c.len], 0, sizeof(rejit_instruction));
+    res->maxdepth = c.depth;
+
+    rejit_free(NULL, c.nodes);
+}
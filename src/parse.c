@@ -10,27 +10,86 @@
 #include <stdio.h>
 #include <ctype.h>
 
-#define ALLOC(tgt,sz,f) do {\
-    (tgt) = calloc(1, sz);\
+// Everything here comes from an arena and goes away with it, so nothing is
+// freed on its own. Temporaries use the token list's arena, which rejit_parse
+// releases in one go once it's done.
+#define ALLOC(a,tgt,sz,f) do {\
+    (tgt) = (void*)rejit_arena_alloc((a), (sz));\
     if ((tgt) == NULL) f;\
 } while (0)
 
-#define REALLOC(tgt,sz,f) do {\
-    void* realloc_r = realloc((tgt), (sz));\
+#define REALLOC(a,tgt,old,sz,f) do {\
+    void* realloc_r = arena_grow((a), (tgt), (old), (sz));\
     if (realloc_r == NULL) {\
-        free((tgt));\
         f;\
     } else (tgt) = realloc_r;\
 } while (0)
 
+struct rejit_arena_type {
+    struct rejit_arena_type* next;
+    size_t len, cap;
+    // What the block came from, and so goes back to.
+    rejit_allocator by;
+    char data[];
+};
+
+#define ARENA_ALIGN sizeof(void*)
+
+// Carve sz zeroed bytes out of the arena. Blocks double in size, so a pattern
+// needs O(log n) allocations for all of its strings and temporaries.
+char* rejit_arena_alloc(struct rejit_arena_type** arena, size_t sz) {
+    struct rejit_arena_type* a = *arena;
+    size_t at = a ? (a->len+ARENA_ALIGN-1) & ~(ARENA_ALIGN-1) : 0;
+    if (a == NULL || a->cap < at || a->cap - at < sz) {
+        size_t cap = a ? a->cap*2 : 4096;
+        rejit_allocator by = rejit_get_allocator();
+        if (cap < sz) cap = sz;
+        a = rejit_alloc(&by, sizeof(struct rejit_arena_type)+cap);
+        if (a == NULL) return NULL;
+        a->cap = cap;
+        a->len = at = 0;
+        a->by = by;
+        a->next = *arena;
+        *arena = a;
+    }
+    a->len = at+sz;
+    return memset(a->data+at, 0, sz);
+}
+
+// Resize p, which holds old bytes. The newest allocation in a block just grows
+// in place while there's room after it.
+static void* arena_grow(struct rejit_arena_type** arena, void* p, size_t old,
+                        size_t sz) {
+    struct rejit_arena_type* a = *arena;
+    char* res;
+    if (p && (char*)p+old == a->data+a->len &&
+        (size_t)((char*)p-a->data) + sz <= a->cap) {
+        memset((char*)p+old, 0, sz-old);
+        a->len += sz-old;
+        return p;
+    }
+    if ((res = rejit_arena_alloc(arena, sz)) != NULL && p) memcpy(res, p, old);
+    return res;
+}
+
+static void arena_free(struct rejit_arena_type* arena) {
+    while (arena) {
+        struct rejit_arena_type* next = arena->next;
+        rejit_free(&arena->by, arena);
+        arena = next;
+    }
+}
+
 rejit_token_list rejit_tokenize(const char* str, rejit_parse_error* err) {
     const char* start = str;
     rejit_token_list tokens;
     int escaped = 0, len;
+    size_t cap = 0;
     rejit_token token;
 
     tokens.tokens = NULL;
     tokens.len = 0;
+    tokens.arena = NULL;
 
     while (*str) {
         int tkind = RJ_TWORD;
@@ -85,11 +144,18 @@ rejit_token_list rejit_tokenize(const char* str, rejit_parse_error* err) {
             // Merge successive TWORDs.
             ++PREV.len;
         else {
-            REALLOC(tokens.tokens, sizeof(rejit_token)*(++tokens.len), {
-                err->kind = RJ_PE_MEM;
-                err->pos = str-start;
-                return tokens;
-            });
+            if (tokens.len == cap) {
+                cap = cap ? cap*2 : 16;
+                REALLOC(&tokens.arena, tokens.tokens,
+                        sizeof(rejit_token)*tokens.len, sizeof(rejit_token)*cap, {
+                    tokens.tokens = NULL;
+                    tokens.len = 0;
+                    err->kind = RJ_PE_MEM;
+                    err->pos = str-start;
+                    return tokens;
+                });
+            }
+            ++tokens.len;
             PREV = token;
         }
     }
@@ -97,20 +163,24 @@ rejit_token_list rejit_tokenize(const char* str, rejit_parse_error* err) {
     return tokens;
 }
 
-void rejit_free_tokens(rejit_token_list tokens) { free(tokens.tokens); }
-
-#define MAXSTACK 256
+void rejit_free_tokens(rejit_token_list tokens) { arena_free(tokens.arena); }
 
 #define STACK(t) struct {\
-    t stack[MAXSTACK];\
-    size_t len;\
+    t* stack;\
+    size_t len, cap;\
 }
 
 #define PUSH(st,t) do {\
-    if (st.len+1 >= MAXSTACK) {\
-        err->kind = RJ_PE_OVFLOW;\
-        return;\
-    };\
+    if (st.len == st.cap) {\
+        st.cap = st.cap ? st.cap*2 : 16;\
+        REALLOC(sk->arena, st.stack, sizeof(*st.stack)*st.len,\
+                sizeof(*st.stack)*st.cap, {\
+            st.stack = NULL;\
+            st.len = st.cap = 0;\
+            err->kind = RJ_PE_MEM;\
+            return;\
+        });\
+    }\
     st.stack[st.len++] = t;\
 } while (0)
 #define POP(st) (st.stack[--st.len])
@@ -121,12 +191,20 @@ typedef struct pipe_type {
     rejit_instruction* instr;
 } pipe;
 
+// The stacks used by build_suffix_pipe_list and parse. They grow with the
+// pattern, in the arena rejit_parse keeps its temporaries in.
+typedef struct parse_stacks_type {
+    struct rejit_arena_type** arena;
+    // Group, pipe, alternative start, and group pipe base stack.
+    STACK(size_t) st, pst, ast, pbs;
+    STACK(rejit_instruction*) groups;
+    STACK(pipe) ors;
+} parse_stacks;
+
 static void build_suffix_pipe_list(const char* str, rejit_token_list tokens,
                                    long* suffixes, pipe* pipes,
-                                   rejit_parse_error* err) {
-    size_t i, prev = -1;
-    STACK(size_t) st, pst; // Group, pipe stack.
-    st.len = pst.len = 0;
+                                   parse_stacks* sk, rejit_parse_error* err) {
+    size_t i, prev = -1, alt = 0;
 
     for (i=0; i<tokens.len; ++i) suffixes[i] = pipes[i].mid = pipes[i].end = -1;
 
@@ -134,12 +212,25 @@ static void build_suffix_pipe_list(const char* str, rejit_token_list tokens,
         rejit_token t = tokens.tokens[i];
 
         if (t.kind == RJ_TLP) {
-            PUSH(st, i);
+            PUSH(sk->st, i);
+            PUSH(sk->ast, alt);
+            PUSH(sk->pbs, sk->pst.len);
+            // (?:, (?= etc. are consumed along with the following word.
+            alt = i+2 < tokens.len && tokens.tokens[i+1].kind == RJ_TQ &&
+                  tokens.tokens[i+2].kind == RJ_TWORD ? i+2 : i+1;
             prev = -1;
         }
         else if (t.kind == RJ_TRP) {
-            prev = POP(st);
-            if (pst.len) pipes[POP(pst)].end = i;
+            if (sk->st.len == 0) {
+                err->kind = RJ_PE_UBOUND;
+                err->pos = t.pos - str;
+                return;
+            }
+            // Every alternative of this group ends here.
+            while (sk->pst.len > TOS(sk->pbs)) pipes[POP(sk->pst)].end = i;
+            (void)POP(sk->pbs);
+            alt = POP(sk->ast);
+            prev = POP(sk->st);
         }
         else if (t.kind > RJ_TSUF) {
             if (prev == -1) {
@@ -151,15 +242,16 @@ static void build_suffix_pipe_list(const char* str, rejit_token_list tokens,
             suffixes[prev] = i;
             prev = -1;
         } else if (t.kind == RJ_TP) {
-            size_t pp;
             if (i+1 == tokens.len) {
                 err->kind = RJ_PE_SYNTAX;
                 err->pos = t.pos - str;
                 return;
             }
-            pp = st.len == 0 ? 0 : TOS(st)+1;
-            pipes[pp].mid = i+1;
-            PUSH(pst, pp);
+            // a|b|c becomes a|(b|c): each pipe opens an RJ_IOR at the start of
+            // the alternative it ends.
+            pipes[alt].mid = i+1;
+            PUSH(sk->pst, alt);
+            alt = i+1;
             prev = -1;
         } else prev = i;
     }
@@ -170,8 +262,8 @@ static char wset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
                      "0123456789_";
 static char sset[] = " \t\n\r\f\v";
 
-static char* expand_set(const char* str, const char* set, size_t len,
-                        rejit_parse_error* err) {
+static char* expand_set(const char* str, struct rejit_arena_type** arena,
+                        const char* set, size_t len, rejit_parse_error* err) {
     size_t rlen = 0;
     char* res, *p;
     int escaped = 0, i;
@@ -191,11 +283,11 @@ static char* expand_set(const char* str, const char* set, size_t len,
         else ++rlen;
     }
 
-    ALLOC(res, rlen*2+2, {
+    if ((res = rejit_arena_alloc(arena, rlen*2+2)) == NULL) {
         err->kind = RJ_PE_MEM;
         err->pos = set-str;
         return NULL;
-    });
+    }
     p = res;
 
     for (i=0; i<len; ++i) {
@@ -217,14 +309,12 @@ static char* expand_set(const char* str, const char* set, size_t len,
 }
 
 static void parse(const char* str, rejit_token_list tokens, long* suffixes,
-                  pipe* pipes, rejit_parse_result* res, rejit_parse_error* err) {
+                  pipe* pipes, parse_stacks* sk, rejit_parse_result* res,
+                  rejit_parse_error* err) {
     size_t i, ninstrs = 0, sl, lbh = 0, lb_later = 0;
-    STACK(rejit_instruction*) st;
-    STACK(pipe) pst;
     char* s;
-    st.len = pst.len = 0;
     sl = strlen(str);
-    ALLOC(res->instrs, sizeof(rejit_instruction)*(tokens.len+1), {
+    ALLOC(&res->arena, res->instrs, sizeof(rejit_instruction)*(tokens.len+1), {
         err->kind = RJ_PE_MEM;
         err->pos = 0;
         return;
@@ -244,7 +334,22 @@ static void parse(const char* str, rejit_token_list tokens, long* suffixes,
         rejit_token t = tokens.tokens[i];
         lb_later = 0;
 
-        if (st.len > res->maxdepth) res->maxdepth = st.len;
+        if (sk->groups.len > res->maxdepth) res->maxdepth = sk->groups.len;
+
+        if (sk->ors.len && i == TOS(sk->ors).mid)
+            TOS(sk->ors).instr->value = (intptr_t)&CUR;
+        while (sk->ors.len && i == TOS(sk->ors).end) {
+            TOS(sk->ors).instr->value2 = (intptr_t)&CUR;
+            LBH(tokens.tokens[TOS(sk->ors).mid], TOS(sk->ors).instr);
+            (void)POP(sk->ors);
+        }
+
+        if (pipes[i].mid != -1) {
+            CUR.kind = RJ_IOR;
+            pipes[i].instr = &CUR;
+            PUSH(sk->ors, pipes[i]);
+            ++ninstrs;
+        }
 
         if (suffixes[i] != -1) {
             rejit_token st = tokens.tokens[suffixes[i]];
@@ -277,28 +382,14 @@ static void parse(const char* str, rejit_token_list tokens, long* suffixes,
             ++ninstrs;
         }
 
-        if (pst.len && i == TOS(pst).mid)
-            TOS(pst).instr->value = (intptr_t)&CUR;
-        else if (pst.len && i == TOS(pst).end) {
-            LBH(tokens.tokens[TOS(pst).mid], TOS(pst).instr);
-            POP(pst).instr->value2 = (intptr_t)&CUR;
-        }
-
-        if (pipes[i].mid != -1) {
-            CUR.kind = RJ_IOR;
-            pipes[i].instr = &CUR;
-            PUSH(pst, pipes[i]);
-            ++ninstrs;
-        }
-
         switch (t.kind) {
         case RJ_TWORD:
             CUR.kind = RJ_IWORD;
-            ALLOC(s, t.len+1, {
+            if ((s = rejit_arena_alloc(&res->arena, t.len+1)) == NULL) {
                 err->kind = RJ_PE_MEM;
                 err->pos = t.pos - str;
                 return;
-            });
+            }
             memcpy(s, t.pos, t.len);
             s[t.len] = 0;
             CUR.value = (intptr_t)s;
@@ -360,22 +451,25 @@ static void parse(const char* str, rejit_token_list tokens, long* suffixes,
                 CUR.kind = RJ_ICGROUP;
                 CUR.value2 = res->groups++;
             }
-            PUSH(st, &CUR);
+            PUSH(sk->groups, &CUR);
             ++ninstrs;
             break;
         case RJ_TRP:
-            if (st.len == 0) {
+            if (sk->groups.len == 0) {
                 err->kind = RJ_PE_UBOUND;
                 err->pos = t.pos - str;
                 return;
             }
-            LBH(t, TOS(st));
-            if (TOS(st)->kind == RJ_ILBEHIND) --lbh;
-            POP(st)->value = (intptr_t)&CUR;
+            TOS(sk->groups)->value = (intptr_t)&CUR;
+            LBH(t, TOS(sk->groups));
+            if (TOS(sk->groups)->kind == RJ_ILBEHIND ||
+                TOS(sk->groups)->kind == RJ_INLBEHIND)
+                --lbh;
+            (void)POP(sk->groups);
             break;
         case RJ_TSET:
             CUR.kind = *t.pos == '^' ? RJ_INSET : RJ_ISET;
-            s = expand_set(str, t.pos+1, t.len-2, err);
+            s = expand_set(str, &res->arena, t.pos+1, t.len-2, err);
             if (err->kind != RJ_PE_NONE) return;
             CUR.value = (intptr_t)s;
             CUR.len = 1;
@@ -395,7 +489,12 @@ static void parse(const char* str, rejit_token_list tokens, long* suffixes,
                 T('w', 'W', w)
                 T('d', 'D', d)
                 }
-                CUR.value = (intptr_t)expand_set(NULL, s, strlen(s), NULL);
+                CUR.value = (intptr_t)expand_set(NULL, &res->arena, s,
+                                                 strlen(s), err);
+                if (err->kind != RJ_PE_NONE) {
+                    err->pos = t.pos - str;
+                    return;
+                }
                 CUR.len = 1;
                 ++ninstrs;
             }
@@ -415,21 +514,339 @@ static void parse(const char* str, rejit_token_list tokens, long* suffixes,
 
     CUR.kind = RJ_INULL;
 
-    if (st.len != 0) {
+    if (sk->groups.len != 0) {
         err->kind = RJ_PE_UBOUND;
         err->pos = sl;
     }
 
-    while (pst.len) {
-        assert(TOS(pst).end == -1);
-        POP(pst).instr->value2 = (intptr_t)&CUR;
+    while (sk->ors.len) {
+        assert(TOS(sk->ors).end == -1);
+        POP(sk->ors).instr->value2 = (intptr_t)&CUR;
+    }
+}
+
+/* Literal alternation factoring.
+
+   An RJ_IOR chain whose alternatives are plain words (foo|foobar|fizz) is
+   rewritten into a prefix trie (f(?:oo(?:|bar)|izz)), so a shared prefix is
+   compared once instead of once per alternative. Two words that start with
+   different bytes can never match at the same position, so they may be
+   regrouped freely; anything else keeps its original relative order, which
+   preserves leftmost-first priority. Lookbehinds are copied verbatim, since
+   their lengths were already computed by the parser. */
+
+typedef struct lit_type {
+    const char* s;
+    size_t len;
+} lit;
+
+typedef struct trie_ctx_type {
+    rejit_instruction* old, *instrs;
+    size_t len, cap;
+    long* map; // Old instruction index -> new index.
+    // The parse result's arena, and the one for temporaries.
+    struct rejit_arena_type** arena, **tmp;
+    int verbatim, failed;
+} trie_ctx;
+
+#define OUT(c,i) ((c)->instrs[i])
+#define FOLD(b) tolower((unsigned char)(b))
+
+static int is_lit(rejit_instruction* b, rejit_instruction* e) {
+    return b == e || (b->kind == RJ_IWORD && b+1 == e);
+}
+
+// The first byte of a literal alternative, or 256 if it is empty.
+static unsigned lit_first(rejit_instruction* b, rejit_instruction* e) {
+    return b == e || !*(char*)b->value ? 256 : (unsigned char)*(char*)b->value;
+}
+
+static long trie_new(trie_ctx* c, rejit_instr_kind kind) {
+    if (c->failed) return -1;
+    if (c->len == c->cap) {
+        c->cap *= 2;
+        REALLOC(c->tmp, c->instrs, sizeof(rejit_instruction)*c->len,
+                sizeof(rejit_instruction)*c->cap, {
+            c->failed = 1;
+            return -1;
+        });
+    }
+    memset(&OUT(c, c->len), 0, sizeof(rejit_instruction));
+    OUT(c, c->len).kind = kind;
+    return c->len++;
+}
+
+static long trie_copy(trie_ctx* c, rejit_instruction* ip) {
+    long at = trie_new(c, ip->kind);
+    if (at == -1) return -1;
+    OUT(c, at) = *ip;
+    c->map[ip - c->old] = at;
+    return at;
+}
+
+static void trie_word(trie_ctx* c, const char* s, size_t len) {
+    char* w;
+    long at;
+    if (!len || c->failed) return;
+    if ((w = rejit_arena_alloc(c->arena, len+1)) == NULL) {
+        c->failed = 1;
+        return;
     }
+    memcpy(w, s, len);
+    if ((at = trie_new(c, RJ_IWORD)) == -1) return;
+    OUT(c, at).value = (intptr_t)w;
+    OUT(c, at).len = len;
+}
+
+static void trie_emit(trie_ctx* c, lit* items, size_t n) {
+    size_t i, p, nch = 0, *cnt = NULL, *pos = NULL;
+    long* ors = NULL, *cidx = NULL;
+    long last_of[256], last_fold[256], barrier = -1, empty = -1;
+    lit* sorted = NULL;
+    unsigned char* keys = NULL;
+
+    for (;;) {
+        if (n == 1) {
+            trie_word(c, items[0].s, items[0].len);
+            return;
+        }
+        // Strip the longest common prefix.
+        p = items[0].len;
+        for (i=1; i<n && p; ++i) {
+            size_t j;
+            for (j=0; j<p && j<items[i].len && items[i].s[j] == items[0].s[j];
+                 ++j);
+            p = j;
+        }
+        if (!p) break;
+        trie_word(c, items[0].s, p);
+        for (i=0; i<n; ++i) {
+            items[i].s += p;
+            items[i].len -= p;
+        }
+    }
+
+    ALLOC(c->tmp, cidx, sizeof(long)*n, goto fail);
+    ALLOC(c->tmp, keys, n, goto fail);
+    for (i=0; i<256; ++i) last_of[i] = last_fold[i] = -1;
+
+    for (i=0; i<n; ++i) {
+        if (!items[i].len) {
+            // An empty word matches anywhere, so nothing may move past it. A
+            // second one is identical to the first and can never win.
+            if (empty != -1) cidx[i] = -1;
+            else cidx[i] = barrier = empty = nch++;
+        } else {
+            unsigned char b = items[i].s[0];
+            long ch = last_of[b];
+            // Join an earlier child with the same byte unless something that
+            // may match the same input (a case variant or an empty word) has
+            // been seen since.
+            if (ch != -1 && ch > barrier && last_fold[FOLD(b)] == ch)
+                cidx[i] = ch;
+            else {
+                keys[nch] = b;
+                cidx[i] = last_of[b] = last_fold[FOLD(b)] = nch++;
+            }
+        }
+    }
+
+    ALLOC(c->tmp, cnt, sizeof(size_t)*(nch+1), goto fail);
+    ALLOC(c->tmp, pos, sizeof(size_t)*(nch+1), goto fail);
+    ALLOC(c->tmp, sorted, sizeof(lit)*n, goto fail);
+    ALLOC(c->tmp, ors, sizeof(long)*nch, goto fail);
+    for (i=0; i<n; ++i) if (cidx[i] != -1) ++cnt[cidx[i]+1];
+    for (i=0; i<nch; ++i) pos[i+1] = cnt[i+1] += cnt[i];
+    for (i=0; i<n; ++i) if (cidx[i] != -1) sorted[pos[cidx[i]]++] = items[i];
+
+    for (i=0; i<nch; ++i) {
+        if (i+1 < nch) ors[i] = trie_new(c, RJ_IOR);
+        if (c->failed) goto fail;
+        trie_emit(c, sorted+cnt[i], cnt[i+1]-cnt[i]);
+        if (c->failed) goto fail;
+        if (i+1 < nch) OUT(c, ors[i]).value = c->len;
+    }
+    for (i=0; i+1<nch; ++i) OUT(c, ors[i]).value2 = c->len;
+
+    fail:
+    if (!cidx || !keys || !cnt || !pos || !sorted || !ors) c->failed = 1;
+}
+
+static rejit_instruction* trie_expr(trie_ctx* c, rejit_instruction* ip);
+
+static void trie_range(trie_ctx* c, rejit_instruction* b, rejit_instruction* e) {
+    while (b != e && !c->failed) b = trie_expr(c, b);
+}
+
+// Whether a run of literal alternatives shares a first byte or repeats the
+// empty word, i.e. whether turning it into a trie changes anything.
+static int run_collides(rejit_instruction** alts, size_t n) {
+    unsigned char seen[256/8+1];
+    size_t i;
+    memset(seen, 0, sizeof(seen));
+    for (i=0; i<n; ++i) {
+        unsigned b = lit_first(alts[i*2], alts[i*2+1]);
+        if (seen[b/8] & 1<<b%8) return 1;
+        seen[b/8] |= 1<<b%8;
+    }
+    return 0;
+}
+
+static rejit_instruction* trie_chain(trie_ctx* c, rejit_instruction* ip) {
+    rejit_instruction* end = (rejit_instruction*)ip->value2, *o, **alts = NULL;
+    size_t n = 2, i, j, k, nors = 0;
+    long* ors = NULL;
+    lit* items = NULL;
+
+    for (o = ip; (rejit_instruction*)o->value != end &&
+                 ((rejit_instruction*)o->value)->kind == RJ_IOR &&
+                 ((rejit_instruction*)o->value)->value2 == (intptr_t)end;
+         o = (rejit_instruction*)o->value) ++n;
+    ALLOC(c->tmp, alts, sizeof(rejit_instruction*)*n*2, goto fail);
+    ALLOC(c->tmp, ors, sizeof(long)*n, goto fail);
+    ALLOC(c->tmp, items, sizeof(lit)*n, goto fail);
+    for (o = ip, i = 0; i<n-1; o = (rejit_instruction*)o->value, ++i) {
+        alts[i*2] = o+1;
+        alts[i*2+1] = (rejit_instruction*)o->value;
+    }
+    alts[i*2] = alts[i*2-1];
+    alts[i*2+1] = end;
+
+    for (i=0; i<n; i = j) {
+        // Find the run of literal alternatives starting at i.
+        for (j=i; j<n && is_lit(alts[j*2], alts[j*2+1]); ++j);
+        if (j-i < 2 || !run_collides(alts+i*2, j-i)) j = i+1;
+
+        if (j < n) {
+            // Reuse the original RJ_IOR so its fields carry over.
+            o = i ? (rejit_instruction*)alts[i*2-1] : ip;
+            if ((ors[nors++] = trie_copy(c, o)) == -1) goto fail;
+        }
+        if (j == i+1) trie_range(c, alts[i*2], alts[i*2+1]);
+        else {
+            for (k=i; k<j; ++k) {
+                rejit_instruction* w = alts[k*2];
+                items[k-i].s = w == alts[k*2+1] ? "" : (char*)w->value;
+                items[k-i].len = strlen(items[k-i].s);
+            }
+            trie_emit(c, items, j-i);
+        }
+        if (c->failed) goto fail;
+        if (j < n) OUT(c, ors[nors-1]).value = c->len;
+    }
+    for (i=0; i<nors; ++i) OUT(c, ors[i]).value2 = c->len;
+
+    fail:
+    if (!alts || !ors || !items) c->failed = 1;
+    return end;
+}
+
+static rejit_instruction* trie_expr(trie_ctx* c, rejit_instruction* ip) {
+    rejit_instruction* end;
+    long at;
+    if (ip->kind == RJ_IOR && !c->verbatim) return trie_chain(c, ip);
+    if ((at = trie_copy(c, ip)) == -1) return ip+1;
+    if (ip->kind == RJ_IOR) {
+        trie_range(c, ip+1, (rejit_instruction*)ip->value);
+        OUT(c, at).value = c->len;
+        trie_range(c, (rejit_instruction*)ip->value,
+                   (rejit_instruction*)ip->value2);
+        OUT(c, at).value2 = c->len;
+        return (rejit_instruction*)ip->value2;
+    } else if (ip->kind > RJ_IVARG) {
+        int lb = ip->kind == RJ_ILBEHIND || ip->kind == RJ_INLBEHIND;
+        end = (rejit_instruction*)ip->value;
+        c->verbatim += lb;
+        trie_range(c, ip+1, end);
+        c->verbatim -= lb;
+        OUT(c, at).value = c->len;
+        return end;
+    } else if (ip->kind > RJ_IARG) return trie_expr(c, ip+1);
+    else return ip+1;
+}
+
+static int trie_wanted(rejit_instruction* b, rejit_instruction* e);
+
+static int trie_wanted_alt(rejit_instruction* b, rejit_instruction* e,
+                           size_t* run, unsigned char* seen) {
+    unsigned c;
+    if (!is_lit(b, e)) {
+        *run = 0;
+        return trie_wanted(b, e);
+    }
+    c = lit_first(b, e);
+    if (!(*run)++) memset(seen, 0, 256/8+1);
+    if (seen[c/8] & 1<<c%8) return 1;
+    seen[c/8] |= 1<<c%8;
+    return 0;
+}
+
+// Whether any chain in the given range would be changed by trie_chain.
+static int trie_wanted(rejit_instruction* b, rejit_instruction* e) {
+    rejit_instruction* o, *mid, *end;
+    unsigned char seen[256/8+1];
+    size_t run;
+    while (b != e) {
+        if (b->kind == RJ_IOR) {
+            end = (rejit_instruction*)b->value2;
+            run = 0;
+            for (o = b;; o = mid) {
+                mid = (rejit_instruction*)o->value;
+                if (trie_wanted_alt(o+1, mid, &run, seen)) return 1;
+                if (mid == end || mid->kind != RJ_IOR ||
+                    mid->value2 != (intptr_t)end) {
+                    if (trie_wanted_alt(mid, end, &run, seen)) return 1;
+                    break;
+                }
+            }
+            b = end;
+        } else if (b->kind == RJ_ILBEHIND || b->kind == RJ_INLBEHIND)
+            b = (rejit_instruction*)b->value;
+        else ++b;
+    }
+    return 0;
+}
+
+static void factor_literal_alts(rejit_parse_result* res,
+                                struct rejit_arena_type** tmp) {
+    trie_ctx c;
+    rejit_instruction* instrs;
+    size_t i, n;
+    for (n=0; res->instrs[n].kind != RJ_INULL; ++n);
+    if (!trie_wanted(res->instrs, &res->instrs[n])) return;
+
+    memset(&c, 0, sizeof(c));
+    c.old = res->instrs;
+    c.arena = &res->arena;
+    c.tmp = tmp;
+    c.cap = n+1;
+    ALLOC(tmp, c.instrs, sizeof(rejit_instruction)*c.cap, return);
+    ALLOC(tmp, c.map, sizeof(long)*(n+1), return);
+    trie_range(&c, res->instrs, &res->instrs[n]);
+    trie_new(&c, RJ_INULL);
+    if (c.failed) return;
+
+    // The old instructions stay in the arena until the result is freed.
+    ALLOC(&res->arena, instrs, sizeof(rejit_instruction)*c.len, return);
+    memcpy(instrs, c.instrs, sizeof(rejit_instruction)*c.len);
+    for (i=0; i<c.len; ++i) {
+        rejit_instruction* ip = &instrs[i];
+        if (ip->kind == RJ_IOR) {
+            ip->value = (intptr_t)&instrs[ip->value];
+            ip->value2 = (intptr_t)&instrs[ip->value2];
+        } else if (ip->kind > RJ_IVARG)
+            ip->value = (intptr_t)&instrs[ip->value];
+        if (ip->len_from)
+            ip->len_from = &instrs[c.map[ip->len_from - c.old]];
+    }
+    res->instrs = instrs;
 }
 
 rejit_parse_result rejit_parse(const char* str, rejit_parse_error* err,
                                rejit_flags flags) {
-    long* suffixes;
-    pipe* pipes;
+    long* suffixes = NULL;
+    pipe* pipes = NULL;
+    parse_stacks sk;
 
     rejit_parse_result res;
     rejit_token_list tokens;
@@ -437,39 +854,35 @@ rejit_parse_result rejit_parse(const char* str, rejit_parse_error* err,
     res.groups = 0;
     res.maxdepth = 0;
     res.flags = flags;
+    res.arena = NULL;
 
     err->kind = RJ_PE_NONE;
     err->pos = 0;
 
     tokens = rejit_tokenize(str, err);
-    if (err->kind != RJ_PE_NONE) return res;
-
-    ALLOC(suffixes, sizeof(long)*tokens.len, {
-        err->kind = RJ_PE_MEM;
-        err->pos = 0;
+    if (err->kind != RJ_PE_NONE) {
+        rejit_free_tokens(tokens);
         return res;
-    });
-    ALLOC(pipes, sizeof(pipe)*tokens.len, {
-        err->kind = RJ_PE_MEM;
-        err->pos = 0;
-        return res;
-    });
-    build_suffix_pipe_list(str, tokens, suffixes, pipes, err);
-    if (err->kind != RJ_PE_NONE) return res;
+    }
+
+    memset(&sk, 0, sizeof(sk));
+    sk.arena = &tokens.arena;
+    ALLOC(sk.arena, suffixes, sizeof(long)*(tokens.len+1),
+          err->kind = RJ_PE_MEM);
+    ALLOC(sk.arena, pipes, sizeof(pipe)*(tokens.len+1), err->kind = RJ_PE_MEM);
+    if (err->kind == RJ_PE_NONE)
+        build_suffix_pipe_list(str, tokens, suffixes, pipes, &sk, err);
+    if (err->kind == RJ_PE_NONE)
+        parse(str, tokens, suffixes, pipes, &sk, &res, err);
+    if (err->kind == RJ_PE_NONE) factor_literal_alts(&res, sk.arena);
+    if (err->kind == RJ_PE_NONE && res.flags & RJ_FSAFE &&
+        rejit_backtrack_risk(res.instrs, res.flags) == RJ_REXP)
+        err->kind = RJ_PE_REDOS;
 
-    parse(str, tokens, suffixes, pipes, &res, err);
-    free(suffixes);
-    free(pipes);
     rejit_free_tokens(tokens);
     return res;
 }
 
 void rejit_free_parse_result(rejit_parse_result p) {
-    int i;
-    for (i=0; p.instrs[i].kind != RJ_INULL; ++i) {
-        if (p.instrs[i].kind > RJ_ISKIP) p.instrs[i].kind -= RJ_ISKIP;
-        if (p.instrs[i].kind == RJ_ISET || p.instrs[i].kind == RJ_IWORD)
-            free((void*)p.instrs[i].value);
-    }
-    free(p.instrs);
+    arena_free(p.arena);
 }
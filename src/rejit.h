@@ -22,6 +22,7 @@
 
 #include <inttypes.h>
 #include <string.h>
+#include <stdio.h>
 
 #if RJ_X86
 typedef uint32_t rj_word;
@@ -42,6 +43,23 @@ typedef struct rejit_group_type {
     const char* begin, *end;
 } rejit_group;
 
+/*! @struct rejit_span32
+    @brief A group, stored as offsets.
+    @discussion
+    The layout groups are written in when compiling with @link RJ_FSPAN32
+    @/link. It is half the size of @link rejit_group @/link and doesn't point
+    into the original string, so it can be stored or sent elsewhere as is.
+    Groups that didn't take part in a match found by @link rejit_search_span32
+    @/link have both fields set to @link RJ_SPAN_NONE @/link.
+
+    @field begin The offset of the beginning of the match.
+    @field end The offset of the end of the match. */
+typedef struct rejit_span32_type {
+    uint32_t begin, end;
+} rejit_span32;
+
+#define RJ_SPAN_NONE UINT32_MAX
+
 /*! @enum rejit_flags
     @brief Compile flags.
     @discussion
@@ -51,16 +69,67 @@ typedef struct rejit_group_type {
     @const RJ_FNONE No flags.
     @const RJ_FICASE Case insensitive matching.
     @const RJ_FDOTALL Make dot (<code>.</code>) also match newlines.
-    @const RJ_FUNICODE Make character classes Unicode-aware. */
+    @const RJ_FUNICODE Make character classes Unicode-aware.
+    @const RJ_FNOCAPTURE Don't write groups. The matcher's @link
+                         //apple_ref/doc/structfield/rejit_matcher/groups
+                         @/link is 0. Patterns with backreferences still
+                         capture, since they need the groups to match.
+    @const RJ_FSPAN32 Write groups as @link rejit_span32 @/link offsets from the
+                      start of the string instead of as pointers. Use @link
+                      rejit_match_span32 @/link and @link rejit_search_span32
+                      @/link to match.
+    @const RJ_FSAFE Make @link rejit_parse @/link fail with @link RJ_PE_REDOS
+                    @/link if the pattern can backtrack exponentially. See
+                    @link rejit_backtrack_risk @/link.
+    @const RJ_FLAZY Interpret the pattern at first instead of compiling it, and
+                    compile it on another thread once its programs have run a
+                    few hundred times, counting each position a search tries.
+                    Matches are the same either way. Without the flag, matchers
+                    are interpreted anyway where executable memory can't be
+                    mapped.
+    @const RJ_FPROFILE Compile the pattern to code that counts which
+                       alternatives it takes and which bytes its sets match,
+                       and compile it again on another thread, trying the
+                       likeliest ones first, once its programs have run about
+                       sixteen thousand times; see @link rejit_reoptimize
+                       @/link. Only alternatives that can't match at the same
+                       position are reordered, so matches are the same either
+                       way. With @link RJ_FLAZY @/link, the pattern is
+                       interpreted until it's first compiled. */
 typedef enum {
-    RJ_FNONE    = 1<<0,
-    RJ_FICASE   = 1<<1,
-    RJ_FDOTALL  = 1<<2,
-    RJ_FUNICODE = 1<<3,
+    RJ_FNONE      = 1<<0,
+    RJ_FICASE     = 1<<1,
+    RJ_FDOTALL    = 1<<2,
+    RJ_FUNICODE   = 1<<3,
+    RJ_FNOCAPTURE = 1<<4,
+    RJ_FSPAN32    = 1<<5,
+    RJ_FSAFE      = 1<<6,
+    RJ_FLAZY      = 1<<7,
+    RJ_FPROFILE   = 1<<8,
 } rejit_flags;
 
 typedef long (*rejit_func)(const char*, rejit_group*);
 
+/*! @enum rejit_anchor
+    @brief How a pattern is anchored.
+    @discussion
+    The value returned from @link rejit_anchoring @/link. Enum values can be
+    bitwise OR'd with other ones.
+
+    @const RJ_ANONE Matches can start anywhere.
+    @const RJ_ABEGIN Every match starts with <code>^</code>.
+    @const RJ_AEND Every match ends with <code>$</code>.
+    @const RJ_ADOTSTAR The pattern starts with <code>.*</code> or
+                       <code>.+</code> and contains no <code>^</code> or
+                       lookbehind. If it fails at one position, it fails at
+                       every position up to the next newline. */
+typedef enum {
+    RJ_ANONE    = 0,
+    RJ_ABEGIN   = 1<<0,
+    RJ_AEND     = 1<<1,
+    RJ_ADOTSTAR = 1<<2,
+} rejit_anchor;
+
 /*! @struct rejit_matcher
     @brief A compiled regex.
     @discussion
@@ -71,10 +140,19 @@ typedef long (*rejit_func)(const char*, rejit_group*);
     @field groups The number of groups that the compiled regex requires.
     @field flags The flags the regex was compiled with. */
 typedef struct rejit_matcher_type {
-    rejit_func func;
-    size_t sz;
+    rejit_func func, scan;
+    size_t sz, scansz;
     int groups;
     rejit_flags flags;
+    rejit_anchor anchor;
+    long minlen, maxlen;
+    // Where each program's helper table starts, or 0 if it has none.
+    size_t help, scanhelp;
+    char* word;
+    struct rejit_cache_entry_type* entry;
+    struct rejit_image_type* image;
+    // The programs to interpret until func is set, if it can be.
+    struct rejit_interp_type* interp;
 }* rejit_matcher;
 
 typedef enum {
@@ -109,14 +187,22 @@ typedef struct rejit_token_type {
 typedef struct rejit_token_list_type {
     rejit_token* tokens;
     size_t len;
+    struct rejit_arena_type* arena;
 } rejit_token_list;
 
 /*! @struct rejit_parse_result
-    @brief The value returned from @link rejit_parse @/link. */
+    @brief The value returned from @link rejit_parse @/link.
+    @discussion
+    The instructions and the words and sets they reference are stored in @link
+    //apple_ref/doc/structfield/rejit_parse_result/arena @/link and live until
+    @link rejit_free_parse_result @/link is called.
+
+    @field arena The blocks holding the instructions and their strings. */
 typedef struct rejit_parse_result_type {
     rejit_instruction* instrs;
     int groups, maxdepth;
     rejit_flags flags;
+    struct rejit_arena_type* arena;
 } rejit_parse_result;
 
 /*! @enum rejit_parse_error_kind
@@ -128,7 +214,9 @@ typedef struct rejit_parse_result_type {
     @const RJ_PE_RANGE Bad character range.
     @const RJ_PE_INT Expected an integer.
     @const RJ_PE_LBVAR Lookbehind contains variable-length expression.
-    @const RJ_PE_MEM Out of memory. */
+    @const RJ_PE_MEM Out of memory.
+    @const RJ_PE_REDOS The pattern can backtrack exponentially, and @link
+                       RJ_FSAFE @/link was given. The position is 0. */
 typedef enum {
     RJ_PE_NONE,
     RJ_PE_SYNTAX,
@@ -138,6 +226,7 @@ typedef enum {
     RJ_PE_INT,
     RJ_PE_LBVAR,
     RJ_PE_MEM,
+    RJ_PE_REDOS,
 } rejit_parse_error_kind;
 
 /*! @struct rejit_parse_error
@@ -170,6 +259,129 @@ rejit_parse_result rejit_parse(const char* str, rejit_parse_error* err,
 /*! @function rejit_free_parse_result
     @brief Free the value returned from @link rejit_parse_result @/link. */
 void rejit_free_parse_result(rejit_parse_result res);
+char* rejit_arena_alloc(struct rejit_arena_type** arena, size_t sz);
+/*! @enum rejit_opt_passes
+    @brief Optimization passes.
+    @discussion
+    The passes @link rejit_optimize @/link can run over a parse result. Enum
+    values can be bitwise OR'd with other ones to run several passes.
+
+    @const RJ_ONONE No passes.
+    @const RJ_OEMPTY Remove empty non-capturing groups and positive lookarounds.
+    @const RJ_OSETWORD Turn sets with one member, like <code>[a]</code>, into
+                       words.
+    @const RJ_OREPWORD Turn fixed repetitions of words, like
+                       <code>a{3}</code>, into words.
+    @const RJ_OALTSET Turn alternations of single characters, like
+                      <code>a|b|[cd]</code>, into sets.
+    @const RJ_OCONCAT Inline non-capturing groups and join the words that end up
+                      next to each other, so <code>(?:ab)c</code> becomes
+                      <code>abc</code>.
+    @const RJ_OALL All of the above. */
+typedef enum {
+    RJ_ONONE    = 0,
+    RJ_OEMPTY   = 1<<0,
+    RJ_OSETWORD = 1<<1,
+    RJ_OREPWORD = 1<<2,
+    RJ_OALTSET  = 1<<3,
+    RJ_OCONCAT  = 1<<4,
+    RJ_OALL     = (1<<5)-1,
+} rejit_opt_passes;
+/*! @function rejit_optimize
+    @brief Simplify the instructions of a parse result.
+    @discussion
+    Rewrite the instructions in @link res @/link in place so they match the same
+    strings and capture the same groups with less work. @link
+    rejit_parse_compile @/link runs every pass. If memory runs out, the
+    instructions are left as they were.
+
+    @param res The value returned from @link rejit_parse @/link.
+    @param passes The passes to run. See @link rejit_opt_passes @/link. */
+void rejit_optimize(rejit_parse_result* res, rejit_opt_passes passes);
+/*! @function rejit_anchoring
+    @brief Find how the pattern in the given instructions is anchored.
+    @result A combination of @link rejit_anchor @/link values. */
+rejit_anchor rejit_anchoring(rejit_instruction* instrs);
+/*! @function rejit_length_bounds
+    @brief Find the shortest and longest strings the pattern in the given
+           instructions can match.
+
+    @param min Where to store the fewest bytes a match can take.
+    @param max Where to store the most bytes a match can take, or -1 if there
+               is no limit. */
+void rejit_length_bounds(rejit_instruction* instrs, long* min, long* max);
+/*! @enum rejit_risk
+    @brief How badly a pattern can backtrack.
+    @discussion
+    The value returned from @link rejit_backtrack_risk @/link. Values are
+    ordered, so a higher one is worse.
+
+    @const RJ_RNONE No ambiguous loops were found.
+    @const RJ_RPOLY Neighbouring loops take the same bytes, like
+                    <code>a*a*</code>, so matching can take polynomial time.
+    @const RJ_REXP Loops are nested or their alternatives start alike, like
+                   <code>(a+)+</code> or <code>(a|ab)*</code>, so matching can
+                   take exponential time. */
+typedef enum {
+    RJ_RNONE,
+    RJ_RPOLY,
+    RJ_REXP,
+} rejit_risk;
+/*! @function rejit_backtrack_risk
+    @brief Find how badly the pattern in the given instructions can backtrack.
+    @discussion
+    Loops are only compared by the bytes they can start with, so this can warn
+    about patterns that never actually blow up.
+
+    @param flags The flags the pattern will be compiled with.
+    @result See @link rejit_risk @/link. */
+rejit_risk rejit_backtrack_risk(rejit_instruction* instrs, rejit_flags flags);
+/*! @struct rejit_analysis
+    @brief The value returned from @link rejit_analyze @/link.
+    @discussion
+    Bytes and literals are as written in the pattern. If it's compiled with
+    @link RJ_FICASE @/link, the literals also match in other cases.
+
+    @field minlen The fewest bytes a match can take.
+    @field maxlen The most bytes a match can take, or -1 if there is no limit.
+    @field anchor How the pattern is anchored. See @link rejit_anchor @/link.
+    @field first The bytes a match can start with, as a bit set. Use @link
+                 RJ_FIRST @/link to test it. If a match can be empty, every byte
+                 is set.
+    @field prefix A string every match starts with, or NULL.
+    @field suffix A string every match ends with, or NULL.
+    @field inner The longest string found in every match, or NULL.
+    @field literal Whether the pattern only matches @link
+                   //apple_ref/doc/structfield/rejit_analysis/prefix @/link.
+    @field backrefs Whether the pattern has backreferences.
+    @field lookaround Whether the pattern has lookaheads or lookbehinds.
+    @field forks A rough estimate of how many backtracking points matching can
+                 leave behind for each byte it consumes.
+    @field risk How badly matching can backtrack. See @link
+                rejit_backtrack_risk @/link. */
+typedef struct rejit_analysis_type {
+    long minlen, maxlen;
+    rejit_anchor anchor;
+    uint8_t first[32];
+    char* prefix, *suffix, *inner;
+    int literal, backrefs, lookaround, forks;
+    rejit_risk risk;
+} rejit_analysis;
+
+#define RJ_FIRST(a,c) ((a).first[(uint8_t)(c)/8]>>(uint8_t)(c)%8 & 1)
+
+/*! @function rejit_analyze
+    @brief Find out what the pattern in a parse result can match.
+    @discussion
+    Nothing is compiled. The result has to be freed with @link
+    rejit_free_analysis @/link.
+
+    @param res The value returned from @link rejit_parse @/link.
+    @result What was found. See @link rejit_analysis @/link. */
+rejit_analysis rejit_analyze(rejit_parse_result res);
+/*! @function rejit_free_analysis
+    @brief Free the value returned from @link rejit_analyze @/link. */
+void rejit_free_analysis(rejit_analysis a);
 int rejit_match_len(rejit_instruction* instr);
 rejit_matcher rejit_compile_instrs(rejit_instruction* instrs, int groups,
                                    int maxdepth, rejit_flags flags);
@@ -181,6 +393,21 @@ rejit_matcher rejit_compile_instrs(rejit_instruction* instrs, int groups,
                  @link rejit_flags @/link.
     @result A compiled regex matcher. */
 rejit_matcher rejit_compile(rejit_parse_result res, rejit_flags flags);
+/*! @function rejit_compile_groups
+    @brief Compile the result of calling @link rejit_parse @/link, capturing
+           only some of its groups.
+    @discussion
+    Groups that aren't asked for are compiled like non-capturing ones. The ones
+    that are fill the group array in order, so if only groups 1 and 3 are
+    wanted, they end up at indexes 0 and 1. Groups that backreferences read
+    are always captured, and come after the ones asked for. See @link
+    rejit_compile @/link for the rest of the arguments.
+
+    @param mask The groups to capture: group <code>i</code> is captured if bit
+                <code>i%64</code> of <code>mask[i/64]</code> is set.
+    @result A compiled regex matcher. */
+rejit_matcher rejit_compile_groups(rejit_parse_result res, rejit_flags flags,
+                                   const uint64_t* mask);
 /*! @function rejit_parse_compile
     @brief Parse and compile the given string.
     @discussion
@@ -188,6 +415,96 @@ rejit_matcher rejit_compile(rejit_parse_result res, rejit_flags flags);
     those two functions for descriptions of the arguments. */
 rejit_matcher rejit_parse_compile(const char* str, rejit_parse_error* err,
                                   rejit_flags flags);
+/*! @typedef rejit_compiler
+    @brief Encoder state kept between compiles.
+    @discussion
+    Compiling through one of these reuses its code and label buffers instead of
+    setting them up and freeing them for every pattern, which adds up when
+    thousands of patterns are compiled at once. A compiler may only be used by
+    one thread at a time. */
+typedef struct rejit_compiler_type rejit_compiler;
+/*! @function rejit_new_compiler
+    @brief Make a compiler.
+    @result The compiler, or NULL if memory ran out. */
+rejit_compiler* rejit_new_compiler(void);
+/*! @function rejit_compiler_compile
+    @brief Like @link rejit_compile @/link, but using the given compiler. */
+rejit_matcher rejit_compiler_compile(rejit_compiler* c, rejit_parse_result res,
+                                     rejit_flags flags);
+/*! @function rejit_compiler_parse_compile
+    @brief Like @link rejit_parse_compile @/link, but using the given compiler. */
+rejit_matcher rejit_compiler_parse_compile(rejit_compiler* c, const char* str,
+                                           rejit_parse_error* err,
+                                           rejit_flags flags);
+rejit_matcher rejit_compiler_compile_instrs(rejit_compiler* c,
+                                            rejit_instruction* instrs,
+                                            int groups, int maxdepth,
+                                            rejit_flags flags);
+/*! @function rejit_free_compiler
+    @brief Free a compiler. Matchers it compiled stay valid. */
+void rejit_free_compiler(rejit_compiler* c);
+/*! @function rejit_compile_many
+    @brief Parse and compile a list of patterns on several threads.
+    @discussion
+    Each thread compiles with its own @link rejit_compiler @/link, taking
+    whichever pattern is next. The programs all go into the shared code
+    regions, which are already executable, so there's nothing to protect
+    afterwards.
+
+    @param patterns The patterns to compile.
+    @param n The number of patterns.
+    @param flags Passed to @link rejit_parse_compile @/link for each pattern.
+    @param nthreads How many threads to use, counting the calling one. 0 uses
+                    one per online CPU.
+    @param matchers Where to put the n matchers. A pattern that doesn't compile
+                    gets NULL.
+    @param errs Where to put the n errors, or NULL.
+    @result The number of patterns that compiled. */
+size_t rejit_compile_many(const char* const* patterns, size_t n,
+                          rejit_flags flags, int nthreads,
+                          rejit_matcher* matchers, rejit_parse_error* errs);
+/*! @struct rejit_static
+    @brief A pattern compiled ahead of time to C by @link rejit_emit_c @/link.
+    @discussion
+    The generated source defines one of these for each pattern, under the name
+    it was given. Pass it to @link rejit_static_matcher @/link to use it like
+    any other matcher. */
+typedef struct rejit_static_type {
+    rejit_func func, scan;
+    int groups;
+    rejit_flags flags;
+    rejit_anchor anchor;
+    long minlen, maxlen;
+    const char* word;
+} rejit_static;
+int rejit_emit_c_instrs(FILE* f, const char* name, rejit_instruction* instrs,
+                        int groups, int maxdepth, rejit_flags flags);
+/*! @function rejit_emit_c
+    @brief Write a pattern out as C source instead of compiling it.
+    @discussion
+    The source defines a @link rejit_static @/link with the given name, and
+    behaves exactly like the matcher @link rejit_compile @/link would return,
+    groups included, without mapping any executable memory. It needs
+    <code>rejit.h</code>, plus <code>utf.h</code> for Unicode classes, on the
+    include path. The output for several patterns can be written to one file.
+
+    @param f The file to write to.
+    @param name The name to define, which has to be a C identifier. Functions
+                named after it are defined too.
+    @param res The parse result to write out.
+    @param flags Flags that affect regex compilation. See
+                 @link rejit_flags @/link.
+    @result 0, or -1 if writing failed or memory ran out. */
+int rejit_emit_c(FILE* f, const char* name, rejit_parse_result res,
+                 rejit_flags flags);
+/*! @function rejit_static_matcher
+    @brief Make a matcher from a pattern compiled by @link rejit_emit_c @/link.
+    @discussion
+    Free it with @link rejit_free_matcher @/link as usual; the pattern itself
+    is left alone.
+
+    @result The matcher, or NULL if memory ran out. */
+rejit_matcher rejit_static_matcher(const rejit_static* s);
 /*! @function rejit_match
     @brief Test if @link //apple_ref/doc/functionparam/rejit_match/str @/link
           starts with the pattern in @link
@@ -200,6 +517,18 @@ rejit_matcher rejit_parse_compile(const char* str, rejit_parse_error* err,
                   then this parameter may be NULL.
     @result The length of the match. */
 int rejit_match(rejit_matcher m, const char* str, rejit_group* groups);
+/*! @function rejit_is_match
+    @brief Test if @link //apple_ref/doc/functionparam/rejit_is_match/str
+           @/link starts with the pattern in @link
+           //apple_ref/doc/functionparam/rejit_is_match/m @/link.
+    @discussion
+    Unlike @link rejit_match @/link, this writes no groups and stops as soon as
+    the match is certain, without running the loops that end the pattern.
+
+    @param m The regex to match.
+    @param str The string to attempt to match.
+    @result 1 if it matches, 0 otherwise. */
+int rejit_is_match(rejit_matcher m, const char* str);
 /*! @brief Test if @link //apple_ref/doc/functionparam/rejit_match/str @/link
            contains the pattern in @link
            //apple_ref/doc/functionparam/rejit_match/m @/link.
@@ -207,14 +536,177 @@ int rejit_match(rejit_matcher m, const char* str, rejit_group* groups);
     @discussion
     See @link rejit_match @/link for a description of the rest of the arguments.
 
+    Each position is tried as if the string started there. A <code>^</code>
+    that doesn't begin every match, like the one in <code>x|^b</code>, matches
+    wherever an attempt starts, so <code>b</code> is found in
+    <code>ab</code>, and lookbehinds can't see before where the attempt
+    started.
+
     @param tgt If the pattern is found in the string, then this will be set to
                point to that location. Otherwise, it will be NULL. If this
                parameter is NULL, then nothing will occur.
     @result The length of the match. */
 int rejit_search(rejit_matcher m, const char* str, const char** tgt,
                  rejit_group* groups);
+/*! @function rejit_match_span32
+    @brief Like @link rejit_match @/link, for matchers compiled with @link
+           RJ_FSPAN32 @/link.
+
+    @param spans Where to write the groups, as offsets from @link
+                 //apple_ref/doc/functionparam/rejit_match_span32/str @/link.
+    @result The length of the match. */
+int rejit_match_span32(rejit_matcher m, const char* str, rejit_span32* spans);
+/*! @function rejit_search_span32
+    @brief Like @link rejit_search @/link, for matchers compiled with @link
+           RJ_FSPAN32 @/link.
+
+    @param tgt If the pattern is found in the string, then this will be set to
+               the offset it was found at. If this parameter is NULL, then
+               nothing will occur.
+    @param spans Where to write the groups, as offsets from @link
+                 //apple_ref/doc/functionparam/rejit_search_span32/str @/link.
+    @result The length of the match. */
+int rejit_search_span32(rejit_matcher m, const char* str, uint32_t* tgt,
+                        rejit_span32* spans);
 /*! @function rejit_free_matcher
     @brief Free the given matcher. */
 void rejit_free_matcher(rejit_matcher m);
+/*! @function rejit_reoptimize
+    @brief Compile a matcher made with @link RJ_FPROFILE @/link again now, by
+           what it has counted so far, instead of waiting for it to run long
+           enough.
+    @discussion
+    The new code doesn't count, and is used as soon as it's ready; matches
+    already running finish with the old code, which is kept until the matcher
+    is freed. A matcher that is still interpreted is compiled without
+    profiling. It's safe to call while other threads use the matcher.
+
+    @result 0, or -1 if the matcher isn't profiled, is already being compiled
+            on another thread, or couldn't be compiled. */
+int rejit_reoptimize(rejit_matcher m);
+/*! @typedef rejit_cache
+    @brief A cache of compiled patterns.
+    @discussion
+    Matchers are shared by every thread that asks for the same pattern and
+    flags. Looking up a pattern that was already compiled takes no lock. */
+typedef struct rejit_cache_type rejit_cache;
+/*! @function rejit_new_cache
+    @brief Create a cache.
+
+    @param budget The bytes the cache may hold before it starts evicting the
+                  least recently used matchers that nobody holds.
+    @result The new cache, or NULL if memory ran out. */
+rejit_cache* rejit_new_cache(size_t budget);
+/*! @function rejit_cache_get
+    @brief Get the matcher for a pattern, compiling it if it isn't cached.
+    @discussion
+    Arguments are like @link rejit_parse_compile @/link's. The matcher stays
+    valid until it's given back with @link rejit_cache_release @/link, and must
+    not be passed to @link rejit_free_matcher @/link.
+
+    @param cache The cache to look in.
+    @result The matcher, or NULL if the pattern didn't compile. */
+rejit_matcher rejit_cache_get(rejit_cache* cache, const char* str,
+                              rejit_parse_error* err, rejit_flags flags);
+/*! @function rejit_cache_release
+    @brief Give back a matcher from @link rejit_cache_get @/link.
+    @discussion
+    Every call to @link rejit_cache_get @/link that returned a matcher needs
+    one of these. */
+void rejit_cache_release(rejit_cache* cache, rejit_matcher m);
+/*! @function rejit_free_cache
+    @brief Free a cache and every matcher in it.
+    @discussion
+    No other thread may be using the cache or its matchers. */
+void rejit_free_cache(rejit_cache* cache);
+/*! @struct rejit_code_stats
+    @brief The value returned from @link rejit_get_code_stats @/link.
+    @discussion
+    Compiled programs are packed into shared executable regions. Freeing a
+    matcher leaves a hole that later programs can reuse. <code>1 -
+    largest/free</code> is how fragmented the free space is.
+
+    @field regions The number of shared regions.
+    @field singles The number of programs mapped on their own, because a
+                   shared region couldn't be made.
+    @field mapped The bytes mapped for programs.
+    @field used The bytes taken by live programs.
+    @field free The bytes in shared regions that are free to reuse.
+    @field largest The largest program that fits without mapping more. */
+typedef struct rejit_code_stats_type {
+    size_t regions, singles, mapped, used, free, largest;
+} rejit_code_stats;
+/*! @function rejit_get_code_stats
+    @brief Find how the memory for compiled programs is being used.
+    @result See @link rejit_code_stats @/link. */
+rejit_code_stats rejit_get_code_stats(void);
+void* rejit_code_alloc(size_t sz, void** rw);
+int rejit_code_seal(void* code, size_t sz);
+void rejit_code_free(void* code, size_t sz);
+void rejit_fill_helpers(void* table);
+/*! @typedef rejit_image
+    @brief Matchers loaded from a file by @link rejit_load_image @/link. */
+typedef struct rejit_image_type rejit_image;
+/*! @function rejit_save_image
+    @brief Write matchers to a file that @link rejit_load_image @/link can load.
+    @discussion
+    The file holds the programs and what's needed to run them, and only loads
+    into processes built from the same version of the library, on CPUs that
+    have every feature the saving one had. Images aren't supported on 32-bit
+    x86, where programs hold their own absolute addresses. Only matchers that
+    have been compiled to machine code can be saved, not ones that are still
+    being interpreted or came from @link rejit_static_matcher @/link, and
+    not ones compiled with @link RJ_FPROFILE @/link, whose code counts into
+    memory of its own process.
+
+    @param path The file to write.
+    @param matchers The matchers to save.
+    @param n The number of matchers.
+    @result 0, or -1 if the file couldn't be written or a matcher can't be
+            saved. */
+int rejit_save_image(const char* path, rejit_matcher* matchers, size_t n);
+/*! @function rejit_load_image
+    @brief Load matchers saved by @link rejit_save_image @/link.
+    @discussion
+    The file is mapped in one piece, and its programs run where they're mapped.
+    The matchers are freed along with the image by @link rejit_free_image
+    @/link, and passing them to @link rejit_free_matcher @/link does nothing.
+
+    @param path The file to load.
+    @param matchers Set to the matchers, in the order they were saved.
+    @param n Set to the number of matchers.
+    @result The image, or NULL if the file couldn't be loaded or doesn't fit
+            this library or CPU. */
+rejit_image* rejit_load_image(const char* path, rejit_matcher** matchers,
+                              size_t* n);
+/*! @function rejit_free_image
+    @brief Unmap an image and free its matchers. */
+void rejit_free_image(rejit_image* img);
+/*! @struct rejit_allocator
+    @brief Where parsing and compiling get their memory from.
+    @discussion
+    Set with @link rejit_set_allocator @/link. Parse results and everything
+    allocated and freed while compiling come from it; matchers, caches, and
+    analyses still use malloc, since they're meant to outlive a request.
+
+    A parse result's memory goes back to the allocator it came from, even if
+    another one has been set since.
+
+    @field alloc Return sz bytes aligned for any type, or NULL.
+    @field free Give back memory from alloc. May be NULL for allocators that
+                release everything at once, like a per-request arena.
+    @field ctx Passed to both. */
+typedef struct rejit_allocator_type {
+    void* (*alloc)(void* ctx, size_t sz);
+    void (*free)(void* ctx, void* p);
+    void* ctx;
+} rejit_allocator;
+/*! @function rejit_set_allocator
+    @brief Set the allocator used by the calling thread.
+    @param a The allocator, which is copied, or NULL to go back to malloc. */
+void rejit_set_allocator(const rejit_allocator* a);
+rejit_allocator rejit_get_allocator(void);
+void* rejit_alloc(rejit_allocator* a, size_t sz);
+void rejit_free(rejit_allocator* a, void* p);
 
 #endif
@@ -2,6 +2,8 @@
    http://creativecommons.org/publicdomain/zero/1.0/ */
 
 #include <libcut.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "rejit.h"
 
 LIBCUT_TEST(test_tokenize) {
@@ -328,6 +330,29 @@ LIBCUT_TEST(test_parse_pipe) {
     LIBCUT_TEST_STREQ((char*)res.instrs[5].value, "c");
 
     LIBCUT_TEST_EQ(res.instrs[6].kind, RJ_INULL);
+
+    PARSE("a|b|c")
+
+    LIBCUT_TEST_EQ(res.maxdepth, 0);
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IOR);
+    LIBCUT_TEST_EQ((void*)res.instrs[0].value, (void*)&res.instrs[2]);
+    LIBCUT_TEST_EQ((void*)res.instrs[0].value2, (void*)&res.instrs[5]);
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[1].value, "a");
+
+    LIBCUT_TEST_EQ(res.instrs[2].kind, RJ_IOR);
+    LIBCUT_TEST_EQ((void*)res.instrs[2].value, (void*)&res.instrs[4]);
+    LIBCUT_TEST_EQ((void*)res.instrs[2].value2, (void*)&res.instrs[5]);
+
+    LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[3].value, "b");
+
+    LIBCUT_TEST_EQ(res.instrs[4].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[4].value, "c");
+
+    LIBCUT_TEST_EQ(res.instrs[5].kind, RJ_INULL);
 }
 
 LIBCUT_TEST(test_parse_lookahead) {
@@ -401,7 +426,7 @@ LIBCUT_TEST(test_parse_pipe_suffix) {
     LIBCUT_TEST_EQ(res.maxdepth, 0);
 
     LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IOR);
-    LIBCUT_TEST_EQ((void*)res.instrs[0].value, (void*)&res.instrs[2]);
+    LIBCUT_TEST_EQ((void*)res.instrs[0].value, (void*)&res.instrs[1]);
     LIBCUT_TEST_EQ((void*)res.instrs[0].value2, (void*)&res.instrs[3]);
 
     LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_ISTAR);
@@ -412,6 +437,64 @@ LIBCUT_TEST(test_parse_pipe_suffix) {
     LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_INULL);
 }
 
+LIBCUT_TEST(test_parse_trie) {
+    rejit_parse_error err;
+    rejit_parse_result res;
+
+    PARSE("foo|foobar|fizz")
+
+    LIBCUT_TEST_EQ(res.maxdepth, 0);
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[0].value, "f");
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_IOR);
+    LIBCUT_TEST_EQ((void*)res.instrs[1].value, (void*)&res.instrs[5]);
+    LIBCUT_TEST_EQ((void*)res.instrs[1].value2, (void*)&res.instrs[6]);
+
+    LIBCUT_TEST_EQ(res.instrs[2].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[2].value, "oo");
+
+    // foo is tried before foobar.
+    LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_IOR);
+    LIBCUT_TEST_EQ((void*)res.instrs[3].value, (void*)&res.instrs[4]);
+    LIBCUT_TEST_EQ((void*)res.instrs[3].value2, (void*)&res.instrs[5]);
+
+    LIBCUT_TEST_EQ(res.instrs[4].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[4].value, "bar");
+
+    LIBCUT_TEST_EQ(res.instrs[5].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[5].value, "izz");
+
+    LIBCUT_TEST_EQ(res.instrs[6].kind, RJ_INULL);
+}
+
+LIBCUT_TEST(test_parse_large) {
+    static char s[8000];
+    static rejit_group groups[1000];
+    char* p = s;
+    int i;
+    rejit_parse_error err;
+    rejit_matcher m;
+
+    for (i=0; i<1000; ++i) p += sprintf(p, "%sx%dy", i ? "|" : "", i);
+    m = rejit_parse_compile(s, &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "x0y", NULL), 3);
+    LIBCUT_TEST_EQ(rejit_match(m, "x999y", NULL), 5);
+    LIBCUT_TEST_EQ(rejit_match(m, "x1000y", NULL), -1);
+
+    for (i=0; i<1000; ++i) s[i] = '(';
+    s[i] = 'a';
+    for (i=0; i<1000; ++i) s[1001+i] = ')';
+    s[2001] = 0;
+    m = rejit_parse_compile(s, &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->groups, 1000);
+    LIBCUT_TEST_EQ(rejit_match(m, "a", groups), 1);
+    LIBCUT_TEST_STREQ(groups[999].begin, "a");
+}
+
 LIBCUT_TEST(test_parse_other) {
     rejit_parse_error err;
     rejit_parse_result res;
@@ -453,6 +536,120 @@ LIBCUT_TEST(test_parse_other) {
     LIBCUT_TEST_EQ(res.instrs[4].kind, RJ_INULL);
 }
 
+#define OPTIMIZE(s,p) PARSE(s) rejit_optimize(&res, p);
+
+LIBCUT_TEST(test_optimize) {
+    rejit_parse_error err;
+    rejit_parse_result res;
+    rejit_matcher m;
+    rejit_group groups[1];
+
+    OPTIMIZE("a(?:)b(?=)", RJ_OEMPTY)
+
+    LIBCUT_TEST_EQ(res.maxdepth, 0);
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[0].value, "a");
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[1].value, "b");
+
+    LIBCUT_TEST_EQ(res.instrs[2].kind, RJ_INULL);
+
+    OPTIMIZE("[a]b[cd]", RJ_OSETWORD)
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[0].value, "a");
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[1].value, "b");
+
+    LIBCUT_TEST_EQ(res.instrs[2].kind, RJ_ISET);
+    LIBCUT_TEST_STREQ((char*)res.instrs[2].value, "cd");
+
+    LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_INULL);
+
+    OPTIMIZE("ab{3}", RJ_OREPWORD)
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[0].value, "ababab");
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_INULL);
+
+    OPTIMIZE("a|b|[cd]|ef|g", RJ_OALTSET)
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IOR);
+    LIBCUT_TEST_EQ((void*)res.instrs[0].value, (void*)&res.instrs[2]);
+    LIBCUT_TEST_EQ((void*)res.instrs[0].value2, (void*)&res.instrs[5]);
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_ISET);
+    LIBCUT_TEST_STREQ((char*)res.instrs[1].value, "abcd");
+
+    // g isn't joined with the others, since ef is tried before it.
+    LIBCUT_TEST_EQ(res.instrs[2].kind, RJ_IOR);
+    LIBCUT_TEST_EQ((void*)res.instrs[2].value, (void*)&res.instrs[4]);
+    LIBCUT_TEST_EQ((void*)res.instrs[2].value2, (void*)&res.instrs[5]);
+
+    LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[3].value, "ef");
+
+    LIBCUT_TEST_EQ(res.instrs[4].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[4].value, "g");
+
+    LIBCUT_TEST_EQ(res.instrs[5].kind, RJ_INULL);
+
+    OPTIMIZE("x(?:a(?:b))c(?:de)*", RJ_OCONCAT)
+
+    LIBCUT_TEST_EQ(res.maxdepth, 0);
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[0].value, "xabc");
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_ISTAR);
+
+    LIBCUT_TEST_EQ(res.instrs[2].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[2].value, "de");
+
+    LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_INULL);
+
+    OPTIMIZE("ab(?<=(?:a)[b])c", RJ_OALL)
+
+    LIBCUT_TEST_EQ(res.maxdepth, 1);
+
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[0].value, "ab");
+
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_ILBEHIND);
+    LIBCUT_TEST_EQ((void*)res.instrs[1].value, (void*)&res.instrs[3]);
+
+    LIBCUT_TEST_EQ(res.instrs[2].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[2].value, "ab");
+    LIBCUT_TEST_EQ(res.instrs[2].len, 2);
+
+    LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_IWORD);
+    LIBCUT_TEST_STREQ((char*)res.instrs[3].value, "c");
+
+    LIBCUT_TEST_EQ(res.instrs[4].kind, RJ_INULL);
+
+    m = rejit_compile(res, RJ_FNONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "abc", NULL), 3);
+    LIBCUT_TEST_EQ(rejit_match(m, "abd", NULL), -1);
+
+    OPTIMIZE("(a)|b|c", RJ_OALL)
+
+    LIBCUT_TEST_EQ(res.groups, 1);
+    LIBCUT_TEST_EQ(res.instrs[0].kind, RJ_IOR);
+    LIBCUT_TEST_EQ(res.instrs[1].kind, RJ_ICGROUP);
+    LIBCUT_TEST_EQ(res.instrs[3].kind, RJ_ISET);
+    LIBCUT_TEST_STREQ((char*)res.instrs[3].value, "bc");
+
+    m = rejit_compile(res, RJ_FNONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "a", groups), 1);
+    LIBCUT_TEST_STREQ(groups[0].end, "");
+    LIBCUT_TEST_EQ(rejit_match(m, "c", groups), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "d", groups), -1);
+}
+
 LIBCUT_TEST(test_chr) {
     // ca
     rejit_instruction instrs[] = {{RJ_IWORD, (intptr_t)"ca"}, {RJ_INULL}};
@@ -470,6 +667,8 @@ LIBCUT_TEST(test_dot) {
     rejit_matcher m = rejit_compile_instrs(instrs, 0, 0, RJ_FNONE);
     LIBCUT_TEST_EQ(rejit_match(m, "c", NULL), 1);
     LIBCUT_TEST_EQ(rejit_match(m, "a", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, " ", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "*", NULL), 1);
     LIBCUT_TEST_EQ(rejit_match(m, "\n", NULL), -1);
     LIBCUT_TEST_EQ(rejit_match(m, "", NULL), -1);
 }
@@ -550,6 +749,15 @@ LIBCUT_TEST(test_set) {
     LIBCUT_TEST_EQ(rejit_match(m, "z", NULL), 1);
     LIBCUT_TEST_EQ(rejit_match(m, "a", NULL), -1);
     LIBCUT_TEST_EQ(rejit_match(m, "", NULL), -1);
+
+    // Members further apart than a word has bits.
+    rejit_parse_error err;
+    m = rejit_parse_compile("[ a~]", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(rejit_match(m, " ", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "a", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "~", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "A", NULL), -1);
+    LIBCUT_TEST_EQ(rejit_match(m, "b", NULL), -1);
 }
 
 LIBCUT_TEST(test_nset) {
@@ -780,6 +988,9 @@ LIBCUT_TEST(test_search) {
     rejit_instruction instrs[] = {{RJ_IWORD, (intptr_t)"a"}, {RJ_INULL}};
     rejit_matcher m = rejit_compile_instrs(instrs, 0, 0, RJ_FNONE);
     const char* tgt;
+    rejit_parse_error err;
+    rejit_group groups[2];
+    const char str1[] = "abxac", str2[] = "abaab";
     LIBCUT_TEST_EQ(rejit_search(m, "abc", &tgt, NULL), 1);
     LIBCUT_TEST_EQ(*tgt, 'c');
     LIBCUT_TEST_EQ(rejit_search(m, "babc", &tgt, NULL), 1);
@@ -787,6 +998,783 @@ LIBCUT_TEST(test_search) {
     tgt = NULL;
     LIBCUT_TEST_EQ(rejit_search(m, "b", &tgt, NULL), -1);
     LIBCUT_TEST_EQ((void*)tgt, NULL);
+
+    // Groups only come from the attempt that matched.
+    m = rejit_parse_compile("(a)(c|d)", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, str1, NULL, groups), 2);
+    LIBCUT_TEST_EQ(groups[0].begin, str1+3);
+    LIBCUT_TEST_EQ(groups[0].end, str1+4);
+    LIBCUT_TEST_EQ(groups[1].begin, str1+4);
+    LIBCUT_TEST_EQ(groups[1].end, str1+5);
+
+    // Backreferences need the groups at every attempt.
+    m = rejit_parse_compile("(a)\\1", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, str2, NULL, groups), 2);
+    LIBCUT_TEST_EQ(groups[0].begin, str2+2);
+    LIBCUT_TEST_EQ(groups[0].end, str2+3);
+
+    // Nor do they keep groups from earlier attempts.
+    m = rejit_parse_compile("(x)?(a)\\2", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "xbaa", NULL, groups), 2);
+    LIBCUT_TEST_EQ((void*)groups[0].begin, NULL);
+    LIBCUT_TEST_EQ((void*)groups[0].end, NULL);
+}
+
+LIBCUT_TEST(test_is_match) {
+    rejit_parse_error err;
+    rejit_group groups[2];
+    rejit_matcher m;
+
+    m = rejit_parse_compile("a(b+)c*", &err, RJ_FNOCAPTURE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->groups, 0);
+    LIBCUT_TEST_EQ(rejit_match(m, "abbcc", NULL), 5);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "abbcc"), 1);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "ab"), 1);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "ac"), 0);
+
+    // The loops in the group at the end don't have to run.
+    m = rejit_parse_compile("a(b(c*))", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "abccc"), 1);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "acb"), 0);
+    LIBCUT_TEST_EQ(rejit_search(m, "xabcc", NULL, groups), 4);
+
+    // Backreferences still capture.
+    m = rejit_parse_compile("(a)\\1", &err, RJ_FNOCAPTURE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->groups, 1);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "aa"), 1);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "ab"), 0);
+}
+
+LIBCUT_TEST(test_compile_groups) {
+    rejit_parse_error err;
+    rejit_parse_result p;
+    rejit_group groups[2];
+    uint64_t mask = 1<<2;
+    const char str[] = "abcab";
+    rejit_matcher m;
+
+    p = rejit_parse("(a)(b)(c)", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    m = rejit_compile_groups(p, RJ_FNONE, &mask);
+    LIBCUT_TEST_EQ(m->groups, 1);
+    LIBCUT_TEST_EQ(rejit_match(m, str, groups), 3);
+    LIBCUT_TEST_EQ(groups[0].begin, str+2);
+    LIBCUT_TEST_EQ(groups[0].end, str+3);
+    rejit_free_matcher(m);
+    // The parse result can still be compiled as a whole.
+    m = rejit_compile(p, RJ_FNONE);
+    LIBCUT_TEST_EQ(m->groups, 3);
+    rejit_free_matcher(m);
+    rejit_free_parse_result(p);
+
+    p = rejit_parse("(a)(b)(c)\\1", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    mask = 1<<1;
+    m = rejit_compile_groups(p, RJ_FNONE, &mask);
+    LIBCUT_TEST_EQ(m->groups, 2);
+    LIBCUT_TEST_EQ(rejit_match(m, "abcb", groups), -1);
+    LIBCUT_TEST_EQ(rejit_match(m, str, groups), 4);
+    LIBCUT_TEST_EQ(groups[0].begin, str+1);
+    LIBCUT_TEST_EQ(groups[0].end, str+2);
+    LIBCUT_TEST_EQ(groups[1].begin, str);
+    LIBCUT_TEST_EQ(groups[1].end, str+1);
+    rejit_free_matcher(m);
+    rejit_free_parse_result(p);
+}
+
+LIBCUT_TEST(test_span32) {
+    rejit_parse_error err;
+    rejit_span32 spans[3];
+    uint32_t tgt;
+    rejit_matcher m;
+
+    m = rejit_parse_compile("(a)(x)?(b+)\\1", &err, RJ_FSPAN32);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match_span32(m, "abba", spans), 4);
+    LIBCUT_TEST_EQ(spans[0].begin, 0);
+    LIBCUT_TEST_EQ(spans[0].end, 1);
+    LIBCUT_TEST_EQ(spans[2].begin, 1);
+    LIBCUT_TEST_EQ(spans[2].end, 3);
+    LIBCUT_TEST_EQ(rejit_match_span32(m, "abbc", spans), -1);
+
+    // Offsets are from the start of the string, not of the match.
+    LIBCUT_TEST_EQ(rejit_search_span32(m, "zzabbba", &tgt, spans), 5);
+    LIBCUT_TEST_EQ(tgt, 2);
+    LIBCUT_TEST_EQ(spans[0].begin, 2);
+    LIBCUT_TEST_EQ(spans[0].end, 3);
+    LIBCUT_TEST_EQ(spans[1].begin, RJ_SPAN_NONE);
+    LIBCUT_TEST_EQ(spans[1].end, RJ_SPAN_NONE);
+    LIBCUT_TEST_EQ(spans[2].begin, 3);
+    LIBCUT_TEST_EQ(spans[2].end, 6);
+    LIBCUT_TEST_EQ(rejit_search_span32(m, "zzabb", &tgt, spans), -1);
+}
+
+LIBCUT_TEST(test_anchoring) {
+    rejit_parse_error err;
+    rejit_parse_result p;
+    rejit_matcher m;
+    rejit_group groups[1];
+    const char* tgt;
+
+    #define ANCHOR(r,a) do {\
+        p = rejit_parse(r, &err, RJ_FNONE);\
+        LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);\
+        LIBCUT_TEST_EQ(rejit_anchoring(p.instrs), a);\
+        rejit_free_parse_result(p);\
+    } while (0)
+    ANCHOR("ab", RJ_ANONE);
+    ANCHOR("^ab", RJ_ABEGIN);
+    ANCHOR("(^a|^b)c", RJ_ABEGIN);
+    ANCHOR("^a|b", RJ_ANONE);
+    ANCHOR("a(b$)", RJ_AEND);
+    ANCHOR("^a$", RJ_ABEGIN | RJ_AEND);
+    ANCHOR("(.*)a", RJ_ADOTSTAR);
+    ANCHOR(".+a|b", RJ_ANONE);
+    ANCHOR(".*^a", RJ_ANONE);
+    ANCHOR(".*(?<!a)b", RJ_ANONE);
+    ANCHOR("(.*)-\\1", RJ_ANONE);
+    ANCHOR("x|^b", RJ_ANONE);
+    ANCHOR("a?^b", RJ_ANONE);
+    #undef ANCHOR
+
+    // ^ only matches at the start of the string.
+    m = rejit_parse_compile("^ab", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "abab", &tgt, NULL), 2);
+    LIBCUT_TEST_EQ(rejit_search(m, "bab", &tgt, NULL), -1);
+
+    m = rejit_parse_compile("b.$", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "bcbd", &tgt, NULL), 2);
+    LIBCUT_TEST_EQ(rejit_search(m, "bcd", &tgt, NULL), -1);
+    LIBCUT_TEST_EQ(rejit_search(m, "b", &tgt, NULL), -1);
+
+    m = rejit_parse_compile(".*x", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "abx", &tgt, NULL), 3);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab\ncx", &tgt, NULL), 2);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab\nc", &tgt, NULL), -1);
+
+    // A lookbehind can't see before the attempt, so a later one can succeed.
+    m = rejit_parse_compile(".*(?<!a)b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab", &tgt, NULL), 1);
+
+    // Nor can a backreference to what the .* took.
+    m = rejit_parse_compile("(.*)-\\1", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab-b", &tgt, groups), 3);
+
+    // A ^ that doesn't begin every match matches where the attempt starts.
+    m = rejit_parse_compile("x|^b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "b", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "cb", NULL), -1);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab", &tgt, NULL), 1);
+    m = rejit_parse_compile("(?:x|^)b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "xb", NULL), 2);
+    LIBCUT_TEST_EQ(rejit_search(m, "cb", &tgt, NULL), 1);
+    m = rejit_parse_compile("a?^b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "ab", NULL), -1);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab", &tgt, NULL), 1);
+    m = rejit_parse_compile("(?=^)b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "ab", NULL), -1);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab", &tgt, NULL), 1);
+}
+
+LIBCUT_TEST(test_length_bounds) {
+    rejit_parse_error err;
+    rejit_parse_result p;
+    rejit_matcher m;
+    const char* tgt;
+    long min, max;
+
+    #define BOUNDS(r,a,b) do {\
+        p = rejit_parse(r, &err, RJ_FNONE);\
+        LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);\
+        rejit_length_bounds(p.instrs, &min, &max);\
+        LIBCUT_TEST_EQ(min, a);\
+        LIBCUT_TEST_EQ(max, b);\
+        rejit_free_parse_result(p);\
+    } while (0)
+    BOUNDS("ab(c|de)f?", 3, 5);
+    BOUNDS("a*", 0, -1);
+    BOUNDS("a+b", 2, -1);
+    BOUNDS("[^x]", 0, 1);
+    BOUNDS("a{2,3}", 2, 3);
+    BOUNDS("a{2,}", 2, 2);
+    BOUNDS("(a)\\1", 1, -1);
+    BOUNDS("^(?=abc)$", 0, 0);
+    BOUNDS("[a\xc3\xa9]", 1, 2);
+    #undef BOUNDS
+
+    // Subjects shorter than any match are never searched.
+    m = rejit_parse_compile("a.c", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->minlen, 3);
+    LIBCUT_TEST_EQ(rejit_search(m, "xxabc", &tgt, NULL), 3);
+    LIBCUT_TEST_EQ(rejit_search(m, "ab", &tgt, NULL), -1);
+    LIBCUT_TEST_EQ(rejit_search(m, "xxab", &tgt, NULL), -1);
+
+    // With a $, only the last maxlen bytes can start a match.
+    m = rejit_parse_compile("a(?:b)?$", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "ababab", &tgt, NULL), 2);
+    LIBCUT_TEST_EQ(tgt - "ababab", 6);
+    LIBCUT_TEST_EQ(rejit_search(m, "aaa", &tgt, NULL), 1);
+    LIBCUT_TEST_EQ(rejit_search(m, "abb", &tgt, NULL), -1);
+    m = rejit_parse_compile("[\xc3\xa9]$", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "x\xc3\xa9", &tgt, NULL), 2);
+}
+
+LIBCUT_TEST(test_analyze) {
+    rejit_parse_error err;
+    rejit_parse_result p;
+    rejit_analysis a;
+
+    #define ANALYZE(r) do {\
+        p = rejit_parse(r, &err, RJ_FNONE);\
+        LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);\
+        a = rejit_analyze(p);\
+        rejit_free_parse_result(p);\
+    } while (0)
+    #define LIT(f,s) LIBCUT_TEST_STREQ(a.f ? a.f : "(null)", s)
+
+    ANALYZE("abc");
+    LIBCUT_TEST_EQ(a.minlen, 3);
+    LIBCUT_TEST_EQ(a.maxlen, 3);
+    LIBCUT_TEST_EQ(a.literal, 1);
+    LIT(prefix, "abc");
+    LIT(suffix, "abc");
+    LIT(inner, "abc");
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'a'), 1);
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'b'), 0);
+    LIBCUT_TEST_EQ(a.forks, 0);
+    rejit_free_analysis(a);
+
+    ANALYZE("^ab[0-9]+xyz.c$");
+    LIBCUT_TEST_EQ(a.anchor, RJ_ABEGIN | RJ_AEND);
+    LIBCUT_TEST_EQ(a.literal, 0);
+    LIT(prefix, "ab");
+    LIT(suffix, "c");
+    LIT(inner, "xyz");
+    LIBCUT_TEST_EQ(a.forks, 1);
+    rejit_free_analysis(a);
+
+    ANALYZE("(foo|fab)(?=x)d|f\\1");
+    LIBCUT_TEST_EQ(a.backrefs, 1);
+    LIBCUT_TEST_EQ(a.lookaround, 1);
+    LIT(prefix, "f");
+    LIBCUT_TEST_EQ(a.suffix, NULL);
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'f'), 1);
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'd'), 0);
+    LIBCUT_TEST_EQ(a.forks, 2);
+    rejit_free_analysis(a);
+
+    ANALYZE("(?:x*[ab])+|[^c]d");
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'x'), 1);
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'b'), 1);
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'd'), 1);
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'c'), 0);
+    LIBCUT_TEST_EQ(a.forks, 3);
+    LIBCUT_TEST_EQ(a.inner, NULL);
+    rejit_free_analysis(a);
+
+    // A match that can be empty can start anywhere.
+    ANALYZE("a?");
+    LIBCUT_TEST_EQ(RJ_FIRST(a, 'z'), 1);
+    LIBCUT_TEST_EQ(a.prefix, NULL);
+    rejit_free_analysis(a);
+
+    #undef ANALYZE
+    #undef LIT
+}
+
+LIBCUT_TEST(test_backtrack_risk) {
+    rejit_parse_error err;
+    rejit_parse_result p;
+    rejit_matcher m;
+
+    #define RISK(r,k) do {\
+        p = rejit_parse(r, &err, RJ_FNONE);\
+        LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);\
+        LIBCUT_TEST_EQ(rejit_backtrack_risk(p.instrs, p.flags), k);\
+        rejit_free_parse_result(p);\
+    } while (0)
+    RISK("a+b*", RJ_RNONE);
+    RISK("(a+b)+", RJ_RNONE);
+    RISK("(ab|cd)*", RJ_RNONE);
+    RISK("a*a+", RJ_RPOLY);
+    RISK(".*x?.*", RJ_RPOLY);
+    RISK("(a+)+", RJ_REXP);
+    RISK("^(\\w+\\s?)*$", RJ_REXP);
+    RISK("(\\d|[0-5])+", RJ_REXP);
+    RISK("(?i)(a|A)+", RJ_REXP);
+    RISK("(a*a*)*", RJ_REXP);
+    RISK("(a|aa)*", RJ_REXP);
+    RISK("(a|ab)*", RJ_REXP);
+    RISK("(b|a|ab)*c", RJ_REXP);
+    RISK("(a|aa)+", RJ_REXP);
+    #undef RISK
+
+    m = rejit_parse_compile("(a+)+b", &err, RJ_FSAFE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_REDOS);
+    LIBCUT_TEST_EQ(m, NULL);
+    m = rejit_parse_compile("a*a*b", &err, RJ_FSAFE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "aab", NULL), 3);
+}
+
+LIBCUT_TEST(test_word_matcher) {
+    rejit_parse_error err;
+    rejit_matcher m;
+    const char* tgt;
+
+    // Words are matched without compiling anything.
+    m = rejit_parse_compile("(?:ab)c", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_STREQ(m->word, "abc");
+    LIBCUT_TEST_EQ(m->func, NULL);
+    LIBCUT_TEST_EQ(rejit_match(m, "abcd", NULL), 3);
+    LIBCUT_TEST_EQ(rejit_match(m, "ab", NULL), -1);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "abc"), 1);
+    LIBCUT_TEST_EQ(rejit_search(m, "ababc", &tgt, NULL), 3);
+    LIBCUT_TEST_EQ(rejit_search(m, "abab", &tgt, NULL), -1);
+    rejit_free_matcher(m);
+
+    m = rejit_parse_compile("xY-z", &err, RJ_FICASE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "XY-Z", NULL), 4);
+    LIBCUT_TEST_EQ(rejit_match(m, "xy_z", NULL), -1);
+    LIBCUT_TEST_EQ(rejit_search(m, "xxyxy-Z", &tgt, NULL), 4);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "Xy-"), 0);
+    rejit_free_matcher(m);
+
+    m = rejit_parse_compile("(abc)", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->word, NULL);
+    rejit_free_matcher(m);
+}
+
+LIBCUT_TEST(test_code_stats) {
+    rejit_parse_error err;
+    rejit_matcher m[64];
+    rejit_code_stats before, during, after;
+    int i;
+
+    before = rejit_get_code_stats();
+    for (i=0; i<64; ++i) {
+        m[i] = rejit_parse_compile("a+(?:b|c)", &err, RJ_FNONE);
+        LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    }
+    during = rejit_get_code_stats();
+    // The programs share regions instead of taking a page each.
+    LIBCUT_TEST_EQ(during.regions < before.regions+2, 1);
+    LIBCUT_TEST_EQ(during.singles, before.singles);
+    LIBCUT_TEST_EQ(during.used > before.used, 1);
+    LIBCUT_TEST_EQ(rejit_match(m[63], "aac", NULL), 3);
+
+    // Freeing every other one leaves holes that fit the same program again.
+    for (i=0; i<64; i += 2) rejit_free_matcher(m[i]);
+    after = rejit_get_code_stats();
+    LIBCUT_TEST_EQ(after.used < during.used, 1);
+    LIBCUT_TEST_EQ(after.largest >= (during.used-before.used)/64, 1);
+    m[0] = rejit_parse_compile("a+(?:b|c)", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(rejit_get_code_stats().mapped, after.mapped);
+    LIBCUT_TEST_EQ(rejit_match(m[0], "ab", NULL), 2);
+    LIBCUT_TEST_EQ(rejit_match(m[1], "ab", NULL), 2);
+    rejit_free_matcher(m[0]);
+    for (i=1; i<64; i += 2) rejit_free_matcher(m[i]);
+}
+
+static void* cache_thread(void* cache) {
+    static const char* pats[] = {"a+b", "(?:c|d)*e", "f.g", "h"};
+    rejit_parse_error err;
+    rejit_matcher m;
+    int i, bad = 0;
+    for (i=0; i<2000; ++i) {
+        m = rejit_cache_get(cache, pats[i%4], &err, RJ_FNONE);
+        if (m == NULL || rejit_match(m, "aab", NULL) != (i%4 == 0 ? 3 : -1))
+            ++bad;
+        if (m) rejit_cache_release(cache, m);
+    }
+    return (void*)(intptr_t)bad;
+}
+
+LIBCUT_TEST(test_cache) {
+    rejit_parse_error err;
+    rejit_cache* c = rejit_new_cache(1<<20);
+    rejit_matcher a, b;
+    pthread_t threads[4];
+    char pat[16];
+    void* bad;
+    int i;
+
+    a = rejit_cache_get(c, "a+b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    b = rejit_cache_get(c, "a+b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(a, b);
+    b = rejit_cache_get(c, "a+b", &err, RJ_FICASE);
+    LIBCUT_TEST_NE(a, b);
+    LIBCUT_TEST_EQ(rejit_match(b, "AAB", NULL), 3);
+    rejit_cache_release(c, a);
+    rejit_cache_release(c, a);
+    rejit_cache_release(c, b);
+    LIBCUT_TEST_EQ(rejit_cache_get(c, "(", &err, RJ_FNONE), NULL);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_UBOUND);
+
+    for (i=0; i<4; ++i) pthread_create(&threads[i], NULL, cache_thread, c);
+    for (i=0; i<4; ++i) {
+        pthread_join(threads[i], &bad);
+        LIBCUT_TEST_EQ(bad, NULL);
+    }
+    rejit_free_cache(c);
+
+    // Matchers that are held aren't evicted, even over budget.
+    c = rejit_new_cache(1);
+    a = rejit_cache_get(c, "x*y", &err, RJ_FNONE);
+    b = rejit_cache_get(c, "z*y", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(rejit_cache_get(c, "x*y", &err, RJ_FNONE), a);
+    LIBCUT_TEST_EQ(rejit_match(a, "xxy", NULL), 3);
+    rejit_cache_release(c, a);
+    rejit_cache_release(c, a);
+    rejit_cache_release(c, b);
+    rejit_free_cache(c);
+
+    // Patterns that keep being used stay while the rest come and go.
+    c = rejit_new_cache(1<<12);
+    a = rejit_cache_get(c, "x*y", &err, RJ_FNONE);
+    rejit_cache_release(c, a);
+    for (i=0; i<256; ++i) {
+        snprintf(pat, sizeof(pat), "%d+x", i);
+        b = rejit_cache_get(c, pat, &err, RJ_FNONE);
+        LIBCUT_TEST_EQ(rejit_match(b, pat, NULL), -1);
+        rejit_cache_release(c, b);
+        b = rejit_cache_get(c, "x*y", &err, RJ_FNONE);
+        LIBCUT_TEST_EQ(rejit_match(b, "xxy", NULL), 3);
+        rejit_cache_release(c, b);
+    }
+    LIBCUT_TEST_EQ(rejit_cache_get(c, "x*y", &err, RJ_FNONE), a);
+    rejit_cache_release(c, a);
+    rejit_free_cache(c);
+}
+
+typedef struct counting_type {
+    int allocs, live;
+} counting;
+
+static void* counting_alloc(void* ctx, size_t sz) {
+    ++((counting*)ctx)->allocs;
+    ++((counting*)ctx)->live;
+    return malloc(sz);
+}
+
+static void counting_free(void* ctx, void* p) {
+    --((counting*)ctx)->live;
+    free(p);
+}
+
+LIBCUT_TEST(test_allocator) {
+    rejit_parse_error err;
+    rejit_parse_result p;
+    rejit_matcher m;
+    counting c = {0, 0};
+    rejit_allocator a = {counting_alloc, counting_free, &c};
+
+    rejit_set_allocator(&a);
+    m = rejit_parse_compile("x(?:foo|fob|bar)+\\d*[a-c]", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    // Everything but the matcher was temporary.
+    LIBCUT_TEST_NE(c.allocs, 0);
+    LIBCUT_TEST_EQ(c.live, 0);
+    LIBCUT_TEST_EQ(rejit_match(m, "xfobbar12c", NULL), 10);
+    rejit_free_matcher(m);
+
+    // Tokens, stacks, instructions, and strings all share a few blocks.
+    c.allocs = 0;
+    p = rejit_parse("(a|b(c|d)*)+[e-g]\\w(?:hi|ho|he)", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(c.allocs < 4, 1);
+    LIBCUT_TEST_EQ(c.live, 1);
+    // The result goes back where it came from.
+    rejit_set_allocator(NULL);
+    rejit_free_parse_result(p);
+    LIBCUT_TEST_EQ(c.live, 0);
+
+    c.allocs = 0;
+    m = rejit_parse_compile("a+b", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(c.allocs, 0);
+    rejit_free_matcher(m);
+}
+
+LIBCUT_TEST(test_compiler) {
+    rejit_parse_error err;
+    rejit_compiler* c = rejit_new_compiler();
+    rejit_matcher m[4];
+    char* big = malloc(30001);
+    int i;
+
+    m[0] = rejit_compiler_parse_compile(c, "a(?:b|c)*d", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    m[1] = rejit_compiler_parse_compile(c, "(?i)hello world", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    // Far more labels than the table starts with.
+    for (i=0; i<30000; i += 5) memcpy(big+i, "[a]?b", 5);
+    big[30000] = 0;
+    m[2] = rejit_compiler_parse_compile(c, big, &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    m[3] = rejit_compiler_parse_compile(c, "x+y", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_compiler_parse_compile(c, "(", &err, RJ_FNONE), NULL);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_UBOUND);
+    rejit_free_compiler(c);
+
+    LIBCUT_TEST_EQ(rejit_match(m[0], "abcbd", NULL), 5);
+    LIBCUT_TEST_EQ(rejit_match(m[1], "HeLLo WORLD", NULL), 11);
+    LIBCUT_TEST_EQ(rejit_match(m[1], "HeLLo WORLx", NULL), -1);
+    memset(big, 'b', 6000);
+    big[6000] = 0;
+    LIBCUT_TEST_EQ(rejit_match(m[2], big, NULL), 6000);
+    LIBCUT_TEST_EQ(rejit_match(m[3], "xxy", NULL), 3);
+    for (i=0; i<4; ++i) rejit_free_matcher(m[i]);
+    free(big);
+}
+
+LIBCUT_TEST(test_compile_many) {
+    enum { N = 200 };
+    char bufs[N][32];
+    const char* patterns[N];
+    rejit_matcher m[N];
+    rejit_parse_error errs[N];
+    int i;
+
+    for (i=0; i<N; ++i) {
+        // Every tenth one is missing its closing parenthesis.
+        sprintf(bufs[i], i%10 == 9 ? "(?:%d|x" : "(?:%d|x)+y", i);
+        patterns[i] = bufs[i];
+    }
+    LIBCUT_TEST_EQ(rejit_compile_many(patterns, N, RJ_FNONE, 4, m, errs),
+                   N-N/10);
+    for (i=0; i<N; ++i) {
+        if (i%10 == 9) {
+            LIBCUT_TEST_EQ(m[i], NULL);
+            LIBCUT_TEST_EQ(errs[i].kind, RJ_PE_UBOUND);
+            continue;
+        }
+        LIBCUT_TEST_EQ(errs[i].kind, RJ_PE_NONE);
+        sprintf(bufs[0], "x%dy", i);
+        LIBCUT_TEST_EQ(rejit_match(m[i], bufs[0], NULL), strlen(bufs[0]));
+        rejit_free_matcher(m[i]);
+    }
+
+    LIBCUT_TEST_EQ(rejit_compile_many(patterns+1, 1, RJ_FNONE, 0, m, NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m[0], "1y", NULL), 2);
+    rejit_free_matcher(m[0]);
+    LIBCUT_TEST_EQ(rejit_compile_many(patterns, 0, RJ_FNONE, 4, m, NULL), 0);
+}
+
+LIBCUT_TEST(test_image) {
+    rejit_parse_error err;
+    rejit_matcher m[4], *loaded;
+    rejit_group groups[1];
+    rejit_image* img;
+    char path[] = "/tmp/rejit-imgXXXXXX";
+    const char* at;
+    size_t n;
+    int fd, i;
+    FILE* f;
+
+    m[0] = rejit_parse_compile("(?:ab|cd)+e", &err, RJ_FNONE);
+    m[1] = rejit_parse_compile("x(\\w+)y", &err, RJ_FUNICODE);
+    m[2] = rejit_parse_compile("hello", &err, RJ_FICASE);
+    m[3] = rejit_parse_compile("\\d+\\s", &err, RJ_FUNICODE);
+    LIBCUT_TEST_NE(fd = mkstemp(path), -1);
+    close(fd);
+    LIBCUT_TEST_EQ(rejit_save_image(path, m, 4), 0);
+    for (i=0; i<4; ++i) rejit_free_matcher(m[i]);
+
+    LIBCUT_TEST_NE(img = rejit_load_image(path, &loaded, &n), NULL);
+    LIBCUT_TEST_EQ(n, 4);
+    LIBCUT_TEST_EQ(rejit_match(loaded[0], "abcde", NULL), 5);
+    LIBCUT_TEST_EQ(rejit_search(loaded[1], "--xÃ_1y", &at, groups), 6);
+    LIBCUT_TEST_EQ(groups[0].end-groups[0].begin, 4);
+    LIBCUT_TEST_EQ(rejit_search(loaded[2], "oh HeLLo", NULL, NULL), 5);
+    LIBCUT_TEST_EQ(rejit_match(loaded[3], "٠1 ", NULL), 4);
+    // Does nothing; the image owns it.
+    rejit_free_matcher(loaded[0]);
+    rejit_free_image(img);
+
+    f = fopen(path, "r+b");
+    fputc('X', f);
+    fclose(f);
+    LIBCUT_TEST_EQ(rejit_load_image(path, &loaded, &n), NULL);
+    remove(path);
+    LIBCUT_TEST_EQ(rejit_load_image(path, &loaded, &n), NULL);
+}
+
+static long ab_func(const char* str, rejit_group* groups) {
+    return str[0] == 'a' && str[1] == 'b' ? 2 : -1;
+}
+
+LIBCUT_TEST(test_emit_c) {
+    const rejit_static ab = {ab_func, ab_func, 0, RJ_FNONE, RJ_ANONE, 2, 2,
+                             NULL};
+    rejit_parse_error err;
+    rejit_parse_result p;
+    rejit_matcher m;
+    char buf[1<<16];
+    size_t n;
+    FILE* f;
+
+    LIBCUT_TEST_NE(f = tmpfile(), NULL);
+    p = rejit_parse("x(b|c)+", &err, RJ_FNONE);
+    rejit_optimize(&p, RJ_OALL);
+    LIBCUT_TEST_EQ(rejit_emit_c(f, "bc", p, RJ_FNONE), 0);
+    rejit_free_parse_result(p);
+    p = rejit_parse("hello", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(rejit_emit_c(f, "hello", p, RJ_FICASE), 0);
+    rejit_free_parse_result(p);
+    rewind(f);
+    n = fread(buf, 1, sizeof(buf)-1, f);
+    buf[n] = 0;
+    fclose(f);
+    LIBCUT_TEST_NE(strstr(buf, "static long bc_func("), NULL);
+    LIBCUT_TEST_NE(strstr(buf, "static long bc_scan("), NULL);
+    LIBCUT_TEST_NE(strstr(buf, "const rejit_static bc = {bc_func, bc_scan, 1,"),
+                   NULL);
+    LIBCUT_TEST_NE(strstr(buf, "RJ_FORK(str,"), NULL);
+    // Words need no program at all.
+    LIBCUT_TEST_EQ(strstr(buf, "hello_func"), NULL);
+    LIBCUT_TEST_NE(strstr(buf, "\"hello\"};"), NULL);
+
+    LIBCUT_TEST_NE(m = rejit_static_matcher(&ab), NULL);
+    LIBCUT_TEST_EQ(rejit_match(m, "abc", NULL), 2);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "ba"), 0);
+    LIBCUT_TEST_EQ(rejit_search(m, "xxab", NULL, NULL), 2);
+    LIBCUT_TEST_EQ(rejit_search(m, "xxa", NULL, NULL), -1);
+    rejit_free_matcher(m);
+}
+
+LIBCUT_TEST(test_lazy) {
+    rejit_parse_error err;
+    rejit_matcher m;
+    rejit_group groups[2];
+    rejit_span32 spans[2];
+    const char* tgt = NULL;
+    int i, pass;
+
+    m = rejit_parse_compile("(a+)(b|cd)?$", &err, RJ_FLAZY);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->groups, 2);
+    // It's interpreted until it has run enough, then compiled.
+    LIBCUT_TEST_EQ(m->func, NULL);
+    for (pass=0; pass<2; ++pass) {
+        memset(groups, 0, sizeof(groups));
+        LIBCUT_TEST_EQ(rejit_match(m, "aacd", groups), 4);
+        LIBCUT_TEST_STREQ(groups[0].begin, "aacd");
+        LIBCUT_TEST_STREQ(groups[0].end, "cd");
+        LIBCUT_TEST_STREQ(groups[1].begin, "cd");
+        LIBCUT_TEST_STREQ(groups[1].end, "");
+        LIBCUT_TEST_EQ(rejit_match(m, "aac", groups), -1);
+        LIBCUT_TEST_EQ(rejit_is_match(m, "ab"), 1);
+        LIBCUT_TEST_EQ(rejit_is_match(m, "abb"), 0);
+        memset(groups, 0, sizeof(groups));
+        LIBCUT_TEST_EQ(rejit_search(m, "xxaa", &tgt, groups), 2);
+        LIBCUT_TEST_STREQ(groups[0].begin, "aa");
+        LIBCUT_TEST_EQ(groups[1].begin, NULL);
+        for (i=0; i<1000; ++i) rejit_search(m, "xxxxxxxxaab", NULL, groups);
+        for (i=0; i<1000 && m->func == NULL; ++i) usleep(1000);
+        LIBCUT_TEST_NE(m->func, NULL);
+    }
+    rejit_free_matcher(m);
+
+    m = rejit_parse_compile("(a|b)c\\1", &err, RJ_FLAZY | RJ_FSPAN32);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match_span32(m, "bcb", spans), 3);
+    LIBCUT_TEST_EQ(spans[0].begin, 0);
+    LIBCUT_TEST_EQ(spans[0].end, 1);
+    LIBCUT_TEST_EQ(rejit_match_span32(m, "bca", spans), -1);
+    LIBCUT_TEST_EQ(rejit_is_match(m, "aca"), 1);
+    // Freeing it while it's being compiled leaves the compile to clean up.
+    for (i=0; i<1000; ++i) rejit_is_match(m, "aca");
+    rejit_free_matcher(m);
+
+    // Words are never interpreted.
+    m = rejit_parse_compile("abc", &err, RJ_FLAZY);
+    LIBCUT_TEST_STREQ(m->word, "abc");
+    rejit_free_matcher(m);
+}
+
+LIBCUT_TEST(test_profile) {
+    rejit_parse_error err;
+    rejit_matcher m;
+    rejit_func f;
+    rejit_group groups[1];
+    int i, pass;
+
+    // Plain matchers have nothing to go on.
+    m = rejit_parse_compile("ab|cd", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(rejit_reoptimize(m), -1);
+    rejit_free_matcher(m);
+
+    // gh is taken most, but ga has to stay after g.
+    m = rejit_parse_compile("(g|ab|cd|ga|gh|[x-z0-4]+)$", &err,
+                            RJ_FPROFILE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_NE(f = m->func, NULL);
+    // Its code counts into memory of this process.
+    LIBCUT_TEST_EQ(rejit_save_image("/tmp/rejit-img-profiled", &m, 1), -1);
+    for (pass=0; pass<2; ++pass) {
+        for (i=0; i<100; ++i) rejit_match(m, "gh", groups);
+        LIBCUT_TEST_EQ(rejit_match(m, "gh", groups), 2);
+        LIBCUT_TEST_STREQ(groups[0].begin, "gh");
+        LIBCUT_TEST_EQ(rejit_match(m, "ga", groups), 2);
+        LIBCUT_TEST_EQ(rejit_match(m, "g", groups), 1);
+        LIBCUT_TEST_EQ(rejit_match(m, "cd", groups), 2);
+        LIBCUT_TEST_EQ(rejit_match(m, "zzx", groups), 3);
+        LIBCUT_TEST_EQ(rejit_match(m, "gx", groups), -1);
+        LIBCUT_TEST_EQ(rejit_search(m, "xxgh", NULL, groups), 2);
+        if (pass == 0) LIBCUT_TEST_EQ(rejit_reoptimize(m), 0);
+    }
+    LIBCUT_TEST_NE(m->func, f);
+    // Once is enough.
+    LIBCUT_TEST_EQ(rejit_reoptimize(m), 0);
+    rejit_free_matcher(m);
+
+    // Left to itself, it's compiled again once it's run long enough.
+    m = rejit_parse_compile("(?:ab|cd)+e", &err, RJ_FPROFILE);
+    f = m->func;
+    for (i=0; i<20000; ++i) rejit_is_match(m, "cdcdabe");
+    for (i=0; i<1000 && __atomic_load_n(&m->func, __ATOMIC_ACQUIRE) == f; ++i)
+        usleep(1000);
+    LIBCUT_TEST_NE(__atomic_load_n(&m->func, __ATOMIC_ACQUIRE), f);
+    LIBCUT_TEST_EQ(rejit_match(m, "cdabe", NULL), 5);
+    rejit_free_matcher(m);
+
+    // Interpreted, then profiled, then compiled for good.
+    m = rejit_parse_compile("a(b|c)", &err, RJ_FLAZY | RJ_FPROFILE);
+    LIBCUT_TEST_EQ(m->func, NULL);
+    for (i=0; i<1000; ++i) rejit_match(m, "ac", groups);
+    for (i=0; i<1000 && __atomic_load_n(&m->func, __ATOMIC_ACQUIRE) == NULL;
+         ++i)
+        usleep(1000);
+    LIBCUT_TEST_NE(f = __atomic_load_n(&m->func, __ATOMIC_ACQUIRE), NULL);
+    for (i=0; i<1000; ++i) rejit_match(m, "ac", groups);
+    LIBCUT_TEST_EQ(rejit_reoptimize(m), 0);
+    LIBCUT_TEST_NE(m->func, f);
+    LIBCUT_TEST_EQ(rejit_match(m, "ac", groups), 2);
+    LIBCUT_TEST_STREQ(groups[0].begin, "c");
+    rejit_free_matcher(m);
 }
 
 LIBCUT_TEST(test_match_len) {
@@ -901,6 +1889,14 @@ LIBCUT_TEST(test_icase_set) {
     LIBCUT_TEST_EQ(rejit_match(m, "C", NULL), 1);
     LIBCUT_TEST_EQ(rejit_match(m, "d", NULL), 1);
     LIBCUT_TEST_EQ(rejit_match(m, "D", NULL), 1);
+
+    // Only the uppercase z fits in the same word as !.
+    rejit_parse_error err;
+    m = rejit_parse_compile("[!z]", &err, RJ_FICASE);
+    LIBCUT_TEST_EQ(rejit_match(m, "!", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "z", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "Z", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_match(m, "y", NULL), -1);
 }
 
 LIBCUT_TEST(test_save) {
@@ -911,6 +1907,66 @@ LIBCUT_TEST(test_save) {
     LIBCUT_TEST_EQ(rejit_match(m, "a", NULL), -1);
 }
 
+LIBCUT_TEST(test_fixed_group) {
+    rejit_parse_error err;
+    rejit_group groups[2];
+    const char str1[] = "acefg", str2[] = "a", str3[] = "abcd";
+    rejit_matcher m;
+
+    // These groups find where they started from their length.
+    m = rejit_parse_compile("(a[bc](?:d|e))(?=fg)f([^x])", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    memset(groups, 0, sizeof(groups));
+    LIBCUT_TEST_EQ(rejit_match(m, str1, groups), 5);
+    LIBCUT_TEST_EQ(groups[0].begin, str1);
+    LIBCUT_TEST_EQ(groups[0].end, str1+3);
+    LIBCUT_TEST_EQ(groups[1].begin, str1+4);
+    LIBCUT_TEST_EQ(groups[1].end, str1+5);
+
+    // [^x] matches the end of the string without consuming it.
+    m = rejit_parse_compile("(a)([^x])", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    memset(groups, 0, sizeof(groups));
+    LIBCUT_TEST_EQ(rejit_match(m, str2, groups), 1);
+    LIBCUT_TEST_EQ(groups[1].begin, str2+1);
+    LIBCUT_TEST_EQ(groups[1].end, str2+1);
+
+    // A UTF-8 member of a set takes all of its bytes.
+    m = rejit_parse_compile("([\xc3\xa9])", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    memset(groups, 0, sizeof(groups));
+    LIBCUT_TEST_EQ(rejit_search(m, "x\xc3\xa9", NULL, groups), 2);
+    LIBCUT_TEST_EQ(groups[0].end-groups[0].begin, 2);
+
+    m = rejit_parse_compile("(?:(ab)|(cd))+", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    memset(groups, 0, sizeof(groups));
+    LIBCUT_TEST_EQ(rejit_match(m, str3, groups), 4);
+    LIBCUT_TEST_EQ(groups[0].begin, str3);
+    LIBCUT_TEST_EQ(groups[0].end, str3+2);
+    LIBCUT_TEST_EQ(groups[1].begin, str3+2);
+    LIBCUT_TEST_EQ(groups[1].end, str3+4);
+}
+
+LIBCUT_TEST(test_deep_group) {
+    rejit_parse_error err;
+    rejit_group groups[6];
+    const char str[] = "fedcbag";
+    rejit_matcher m;
+    int i;
+
+    // Nested deeper than there are registers to save positions in.
+    m = rejit_parse_compile("(a|(b|(c|(d|(e|(f))))))+g", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    memset(groups, 0, sizeof(groups));
+    LIBCUT_TEST_EQ(rejit_match(m, str, groups), 7);
+    for (i=0; i<6; ++i) {
+        LIBCUT_TEST_EQ(groups[i].begin, str+5-i);
+        LIBCUT_TEST_EQ(groups[i].end, str+6-i);
+    }
+    LIBCUT_TEST_EQ(rejit_match(m, "fedcba", groups), -1);
+}
+
 LIBCUT_TEST(test_long_word) {
     rejit_instruction instrs[] = {{RJ_IWORD, (intptr_t)"abcdefghij"}, {RJ_INULL}};
     rejit_matcher m = rejit_compile_instrs(instrs, 0, 0, RJ_FNONE);
@@ -1016,6 +2072,58 @@ LIBCUT_TEST(test_misc) {
     LIBCUT_TEST_STREQ(groups[1].end, "a");
     LIBCUT_TEST_STREQ(groups[2].begin, "a");
     LIBCUT_TEST_STREQ(groups[2].end, "");
+
+    m = rejit_parse_compile("(?:foo|foobar|fizz|bar)baz", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->groups, 0);
+    LIBCUT_TEST_EQ(rejit_match(m, "foobaz", NULL), 6);
+    LIBCUT_TEST_EQ(rejit_match(m, "foobarbaz", NULL), 9);
+    LIBCUT_TEST_EQ(rejit_match(m, "fizzbaz", NULL), 7);
+    LIBCUT_TEST_EQ(rejit_match(m, "barbaz", NULL), 6);
+    LIBCUT_TEST_EQ(rejit_match(m, "fobaz", NULL), -1);
+
+    memset(groups, 0, sizeof(groups));
+    m = rejit_parse_compile("(ab|a)(c|bcd)", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->groups, 2);
+    LIBCUT_TEST_EQ(rejit_match(m, "abcd", groups), 3);
+    LIBCUT_TEST_STREQ(groups[0].end, "cd");
+    LIBCUT_TEST_STREQ(groups[1].end, "d");
+
+    // Backtracking out of the loop has to undo the saves made in it.
+    memset(groups, 0, sizeof(groups));
+    m = rejit_parse_compile("((a|ab)+)(c|bcd)", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(m->groups, 3);
+    LIBCUT_TEST_EQ(rejit_match(m, "ababcd", groups), 6);
+    LIBCUT_TEST_STREQ(groups[0].begin, "ababcd");
+    LIBCUT_TEST_STREQ(groups[0].end, "bcd");
+    LIBCUT_TEST_STREQ(groups[1].begin, "abcd");
+    LIBCUT_TEST_STREQ(groups[1].end, "bcd");
+    LIBCUT_TEST_STREQ(groups[2].begin, "bcd");
+
+    // [^x] matches the end of the string without consuming it, so loops over
+    // it stop there instead of matching it forever.
+    m = rejit_parse_compile("(?:a|[^b]+?)+", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "a", NULL), 1);
+    LIBCUT_TEST_EQ(rejit_search(m, "a", NULL, NULL), 1);
+    LIBCUT_TEST_EQ(rejit_search(m, "xa", NULL, NULL), 2);
+    m = rejit_parse_compile("[^b]*", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "a", NULL), 1);
+    m = rejit_parse_compile("[^b]*?c", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "a", NULL), -1);
+
+    // Alternatives that could start at the current byte keep their fork.
+    m = rejit_parse_compile("(?:(a(?:b)*(?:aa){0,2})|(?:ccc)*[^b]+?)+", &err,
+                            RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_match(m, "abb", groups), 3);
+    m = rejit_parse_compile("((?<=bb)(bbb)){0,2}[^b]*|c$", &err, RJ_FNONE);
+    LIBCUT_TEST_EQ(err.kind, RJ_PE_NONE);
+    LIBCUT_TEST_EQ(rejit_search(m, "bbacbca", NULL, groups), -1);
 }
 
 LIBCUT_MAIN(
@@ -1023,7 +2131,8 @@ LIBCUT_MAIN(
 
     test_parse_word, test_parse_suffix, test_parse_group, test_parse_set,
     test_parse_pipe, test_parse_lookahead, test_parse_lookbehind,
-    test_parse_pipe_suffix, test_parse_other,
+    test_parse_pipe_suffix, test_parse_trie, test_parse_large,
+    test_parse_other, test_optimize,
 
     test_chr, test_dot, test_plus, test_star, test_opt, test_rep, test_begin,
     test_end, test_set, test_nset, test_uset, test_or, test_group, test_cgroup,
@@ -1031,8 +2140,12 @@ LIBCUT_MAIN(
     test_negative_lookahead, test_lookbehind, test_negative_lookbehind,
     test_mplus, test_mstar, test_or_mixed, test_set_and_dot, test_or_group,
     test_back, test_dotall, test_icase_word, test_icase_set, test_save,
-    test_long_word, test_empty_group,
+    test_fixed_group, test_deep_group, test_long_word, test_empty_group,
 
-    test_search, test_match_len,
+    test_search, test_is_match, test_compile_groups,
+    test_span32, test_anchoring, test_length_bounds,
+    test_analyze, test_backtrack_risk, test_word_matcher, test_code_stats,
+    test_cache, test_allocator, test_compiler, test_compile_many,
+    test_image, test_emit_c, test_lazy, test_profile, test_match_len,
 
     test_misc)